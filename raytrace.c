@@ -1,16 +1,52 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
 
+#ifndef IMAGE_WIDTH
 #define IMAGE_WIDTH 240
+#endif
+#ifndef IMAGE_HEIGHT
 #define IMAGE_HEIGHT 180
+#endif
+#ifndef SAMPLE_COUNT
 #define SAMPLE_COUNT 8192
+#endif
+#ifndef BOUNCE_COUNT
 #define BOUNCE_COUNT 4
+#endif
+#define TILE_SIZE 16
+#define CHECKPOINT_INTERVAL 60
+// samples per distributed job, jobs are one tile times this many samples
+#define JOB_SAMPLES 256
+// adaptive sampling never judges a pixel on fewer samples than this
+#define ADAPTIVE_MIN_SAMPLES 16
+#define MAX_THREADS 256
 
 typedef struct {
 	float x, y, z;
@@ -20,10 +56,29 @@ typedef struct {
 	uint8_t r, g, b;
 } Color8;
 
+// material classes, each shaded by its own specialized kernel
+enum { MATERIAL_DIFFUSE, MATERIAL_METAL, MATERIAL_DIELECTRIC, MATERIAL_LAYERED, MATERIAL_CLASS_COUNT };
+
 typedef struct {
+	int kind;
 	Vector3 color;
+	// layered only, a metal is 1 throughout and everything else 0
+	float metallic;
+	float roughness;
+	// dielectric only: index of refraction and how much of the light that
+	// isn't reflected goes through rather than being scattered diffusely
+	float ior;
+	float transmission;
+	Vector3 emission;
+	// empty for the ones sphere statements make up on the spot
+	char name[32];
+} Material;
+
+typedef struct {
 	Vector3 center;
 	float radius;
+	// index into materials
+	int material;
 } Sphere;
 
 typedef struct {
@@ -31,17 +86,608 @@ typedef struct {
 	Vector3 direction;
 } Line;
 
+typedef struct {
+	Vector3 origin;
+	Vector3 forward;
+	Vector3 right;
+	Vector3 up;
+	// half the height of the image plane one unit in front of the camera
+	float scale;
+} Camera;
+
+// object to world (or back) as rows of a 3x4 matrix, the last column is
+// the translation
+typedef struct {
+	float m[3][4];
+} Transform;
+
+// a named group of spheres, object_spheres[first .. first + count), that
+// is only stored once however often it is placed in the scene
+typedef struct {
+	char name[32];
+	int first;
+	int count;
+} Object;
+
+// one placement of an object: moved to position, turned yaw degrees about
+// the y axis and scaled per axis, so spheres can become ellipsoids
+typedef struct {
+	int object;
+	Vector3 position;
+	float yaw;
+	Vector3 scale;
+	Transform toWorld;
+	Transform toObject;
+} Instance;
+
+typedef struct {
+	Vector3 min;
+	Vector3 max;
+} Box;
+
+typedef struct {
+	Box box;
+	int first; // the subtree holds items[first .. first + count)
+	int count;
+	float area; // surface area of every box in the subtree
+	float cost; // area relative to the node's own box when it was built
+	int worse; // this node or one below got worse than BVH_REBUILD_RATIO
+} BvhNode;
+
+typedef struct {
+	BvhNode *nodes;
+	int *items;
+	Box *boxes; // bounds of every item, kept up to date by the owner
+	int count;
+	int depth;
+} Bvh;
+
+void bvh_free(Bvh *bvh) {
+	free(bvh->nodes);
+	free(bvh->items);
+	memset(bvh, 0, sizeof(*bvh));
+}
+
+typedef struct {
+	// index into spheres, or into object_spheres when instance isn't -1.
+	// -1 when the ray escapes to the sky
+	int sphere;
+	int instance;
+	float distance;
+	Vector3 point;
+	Vector3 normal;
+} Hit;
+
 int inSafeRange(float x) {
 	float y = x < 0 ? -x : x;
 	return 1e-5 < y && y < 1e5;
 }
 
+// in-process sampling profiler (--profile), SIGPROF fires every
+// PROFILE_INTERVAL_US of cpu time and charges the tick to whatever stage
+// the interrupted thread marked itself as being in
+#define PROFILE_INTERVAL_US 1000
+
+enum {
+	STAGE_OTHER,
+	STAGE_TRACE,
+	STAGE_INTERSECT,
+	STAGE_BRDF,
+	STAGE_SAMPLING,
+	STAGE_RNG,
+	STAGE_TONEMAP,
+	STAGE_ENCODE,
+	STAGE_COUNT
+};
+
+const char *stage_names[STAGE_COUNT] = {
+	"other",
+	"ray_trace",
+	"line_sphere_intersect",
+	"reflectance_function",
+	"sampling",
+	"random_float",
+	"tone_map",
+	"stbi_write_png"
+};
+
+_Thread_local volatile sig_atomic_t profile_stage = STAGE_OTHER;
+atomic_ulong profile_samples[STAGE_COUNT];
+double profile_cpu_seconds;
+
+double cpu_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int profile_enter(int stage) {
+	int previous = profile_stage;
+	profile_stage = stage;
+	return previous;
+}
+
+void profile_leave(int previous) {
+	profile_stage = previous;
+}
+
+void profile_signal(int signal) {
+	(void)signal;
+	atomic_fetch_add_explicit(&profile_samples[profile_stage], 1, memory_order_relaxed);
+}
+
+void profile_start() {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profile_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = PROFILE_INTERVAL_US;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+	profile_cpu_seconds = cpu_time();
+}
+
+void profile_stop() {
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	signal(SIGPROF, SIG_IGN);
+	profile_cpu_seconds = cpu_time() - profile_cpu_seconds;
+}
+
+int profile_write(const char *path) {
+	FILE *file = strcmp(path, "-") ? fopen(path, "w") : stderr;
+	if (!file)
+		return 0;
+
+	int order[STAGE_COUNT];
+	unsigned long total = 0;
+	for (int i = 0; i < STAGE_COUNT; ++i) {
+		order[i] = i;
+		total += profile_samples[i];
+	}
+	// a handful of stages, insertion sort by sample count
+	for (int i = 1; i < STAGE_COUNT; ++i)
+		for (int j = i; 0 < j && profile_samples[order[j - 1]] < profile_samples[order[j]]; --j) {
+			int t = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = t;
+		}
+
+	// the kernel rounds the interval up to its tick, so seconds are scaled
+	// from the measured process cpu time rather than samples * interval
+	fprintf(file, "flat profile, %lu samples over %.3f cpu seconds\n", total, profile_cpu_seconds);
+	fprintf(file, "%7s %10s %10s  %s\n", "% time", "samples", "seconds", "stage");
+	for (int i = 0; i < STAGE_COUNT; ++i) {
+		unsigned long samples = profile_samples[order[i]];
+		fprintf(file, "%6.2f%% %10lu %10.3f  %s\n",
+			total ? 100.0 * samples / total : 0.0, samples,
+			total ? profile_cpu_seconds * samples / total : 0.0, stage_names[order[i]]);
+	}
+
+	return file == stderr ? 1 : fclose(file) == 0;
+}
+
+// every thread owns its generator so samples don't fight over rand()'s lock,
+// and reseeding per pixel/sample keeps the image independent of thread count
+_Thread_local uint32_t random_state;
+// --seed, picks a different but equally deterministic set of samples
+uint32_t render_seed = 0;
+
+void random_seed(uint32_t pixel, uint32_t sample) {
+	uint32_t h = pixel * 0x9e3779b9u ^ (sample + 0x7f4a7c15u) * 0x85ebca6bu ^ render_seed * 0xc2b2ae35u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	random_state = h;
+}
+
 float random_float() {
+	int stage = profile_enter(STAGE_RNG);
 	float result;
-	result = ((float)rand())/RAND_MAX;
+	// pcg32 (rxs-m-xs variant), 24 bits are all a float can hold
+	random_state = random_state * 747796405u + 2891336453u;
+	uint32_t word = ((random_state >> ((random_state >> 28u) + 4u)) ^ random_state) * 277803737u;
+	word = (word >> 22u) ^ word;
+	result = (float)(word >> 8) * (1.0f / 16777215.0f);
+	profile_leave(stage);
+	return result;
+}
+
+// quasi-random path samples. every decision a path makes (a direction, a
+// choice between lobes) takes the next dimension group, up to 4
+// coordinates of a sobol sequence indexed by the sample number. each
+// group of each pixel gets its own owen scramble and its own shuffle of
+// the sample order, so groups don't correlate with each other and
+// neighbouring pixels don't repeat the same points, while the samples of
+// one pixel stay stratified in every group (burley 2020). random_float
+// stays for anything that isn't part of a path
+#define SOBOL_DIMENSIONS 4
+
+const uint32_t sobol_directions[SOBOL_DIMENSIONS][32] = {
+	{0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u, 0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u, 0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u, 0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u},
+	{0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u, 0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u, 0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u, 0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu},
+	{0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u, 0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u, 0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u, 0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u},
+	{0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u, 0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u, 0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u, 0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u}
+};
+
+_Thread_local uint32_t sampler_pixel;
+_Thread_local int sampler_x, sampler_y;
+_Thread_local uint32_t sampler_sample;
+_Thread_local uint32_t sampler_dimension;
+
+void sampler_start(uint32_t pixel, int x, int y, uint32_t sample) {
+	sampler_pixel = pixel;
+	sampler_x = x;
+	sampler_y = y;
+	sampler_sample = sample;
+	sampler_dimension = 0;
+}
+
+uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// a random permutation of x where every bit only depends on the bits
+// above it, which is an owen scramble (laine and karras' hash, applied
+// to reversed bits)
+uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+uint32_t hash_mix(uint32_t a, uint32_t b) {
+	uint32_t h = a * 0x9e3779b9u ^ (b + 0x7f4a7c15u) * 0x85ebca6bu;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// blue noise previews (--blue-noise). instead of scrambling every pixel
+// on its own, all pixels share a dimension group's scramble and xor it
+// with a blue noise mask, so what error is left at a few samples per
+// pixel sits in high frequencies the eye and a denoiser mostly ignore.
+// the xor is a digital shift, which keeps each pixel's samples exactly as
+// stratified as before, where adding the mask would not. each coordinate
+// reads the mask at its own offset, and every frame moves all of them on
+// by the golden ratio so error doesn't stand still in animations
+#define BLUE_NOISE_SIZE 64
+#define BLUE_NOISE_SIGMA 1.5
+
+int blue_noise = 0;
+// which frame of an animation is rendering
+uint32_t sampler_frame = 0;
+// ranks 0 .. BLUE_NOISE_SIZE^2 - 1, every value once
+uint16_t blue_noise_mask[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+
+// energy of the pixels set in a pattern, a gaussian around each one on a
+// torus so the mask tiles. flipping a pixel adds or takes away its kernel
+void blue_noise_splat(float *energy, const float *kernel, int pixel, float sign) {
+	int px = pixel % BLUE_NOISE_SIZE, py = pixel / BLUE_NOISE_SIZE;
+	for (int y = 0; y < BLUE_NOISE_SIZE; ++y) {
+		int dy = abs(y - py);
+		dy = dy < BLUE_NOISE_SIZE - dy ? dy : BLUE_NOISE_SIZE - dy;
+		for (int x = 0; x < BLUE_NOISE_SIZE; ++x) {
+			int dx = abs(x - px);
+			dx = dx < BLUE_NOISE_SIZE - dx ? dx : BLUE_NOISE_SIZE - dx;
+			energy[y * BLUE_NOISE_SIZE + x] += sign * kernel[dy * BLUE_NOISE_SIZE + dx];
+		}
+	}
+}
+
+// the set pixel with the most energy around it, or the empty one with the
+// least
+int blue_noise_extreme(const float *energy, const uint8_t *pattern, int set) {
+	int result = -1;
+	for (int i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; ++i) {
+		if (pattern[i] != set)
+			continue;
+		if (result < 0 || (set ? energy[i] > energy[result] : energy[i] < energy[result]))
+			result = i;
+	}
 	return result;
 }
 
+// ulichney's void and cluster. a few percent of pixels start out set at
+// random and are moved from their tightest cluster into the largest void
+// until that changes nothing. ranks then count down while clusters are
+// taken out of a copy and up while voids are filled in the original,
+// until every pixel is set. on a torus an empty pixel's energy from the
+// empty ones is a constant minus its energy from the set ones, so filling
+// the largest void also does the second half of the usual algorithm
+void blue_noise_build() {
+	enum { N = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE };
+	float *kernel = malloc(N * sizeof(float));
+	float *energy = calloc(N, sizeof(float));
+	float *start = malloc(N * sizeof(float));
+	uint8_t *pattern = calloc(N, 1);
+	uint8_t *initial = malloc(N);
+	assert(kernel && energy && start && pattern && initial);
+	for (int y = 0; y < BLUE_NOISE_SIZE; ++y)
+		for (int x = 0; x < BLUE_NOISE_SIZE; ++x)
+			kernel[y * BLUE_NOISE_SIZE + x] = expf(-(x * x + y * y) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+
+	int ones = 0;
+	random_seed(0, 0);
+	while (ones < N / 10) {
+		int i = (int)(random_float() * (N - 1));
+		if (!pattern[i]) {
+			pattern[i] = 1;
+			blue_noise_splat(energy, kernel, i, 1.0f);
+			ones += 1;
+		}
+	}
+	for (int moves = 0; moves < N; ++moves) {
+		int cluster = blue_noise_extreme(energy, pattern, 1);
+		pattern[cluster] = 0;
+		blue_noise_splat(energy, kernel, cluster, -1.0f);
+		int empty = blue_noise_extreme(energy, pattern, 0);
+		pattern[empty] = 1;
+		blue_noise_splat(energy, kernel, empty, 1.0f);
+		if (empty == cluster)
+			break;
+	}
+
+	memcpy(initial, pattern, N);
+	memcpy(start, energy, N * sizeof(float));
+	for (int rank = ones - 1; rank >= 0; --rank) {
+		int cluster = blue_noise_extreme(energy, pattern, 1);
+		pattern[cluster] = 0;
+		blue_noise_splat(energy, kernel, cluster, -1.0f);
+		blue_noise_mask[cluster] = rank;
+	}
+	memcpy(pattern, initial, N);
+	memcpy(energy, start, N * sizeof(float));
+	for (int rank = ones; rank < N; ++rank) {
+		int empty = blue_noise_extreme(energy, pattern, 0);
+		pattern[empty] = 1;
+		blue_noise_splat(energy, kernel, empty, 1.0f);
+		blue_noise_mask[empty] = rank;
+	}
+
+	free(kernel);
+	free(energy);
+	free(start);
+	free(pattern);
+	free(initial);
+}
+
+// the mask as bits to flip in a 32 bit fixed point coordinate, for coordinate
+// number coordinate. offsets follow the r2 sequence, which keeps the
+// copies the coordinates read far apart
+uint32_t blue_noise_shift(int x, int y, uint32_t coordinate) {
+	x = (x + ((coordinate * 0xc13fa9a9u) >> 26)) % BLUE_NOISE_SIZE;
+	y = (y + ((coordinate * 0x91e10da6u) >> 26)) % BLUE_NOISE_SIZE;
+	uint32_t rank = blue_noise_mask[y * BLUE_NOISE_SIZE + x];
+	// the middle of the rank's interval, then the frame's golden ratio step
+	return (rank * 2 + 1) * (0x80000000u / (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE)) + sampler_frame * 0x9e3779b9u;
+}
+
+// primary sample space metropolis (--integrator mlt) gives a path its
+// coordinates from a markov chain instead. a coordinate is only brought up
+// to date (the small steps it missed, or a fresh value after a large step)
+// once a path actually reads it, so short paths don't pay for long ones
+// (kelemen et al. 2002, laid out as in pbrt)
+#define MLT_DIMENSIONS 64
+#define MLT_SIGMA 0.01f
+#define MLT_LARGE_STEP 0.3f
+
+typedef struct {
+	float value;
+	// the iteration value was last brought up to date in
+	uint32_t modified;
+	// what to go back to if the mutation is rejected
+	float backup;
+	uint32_t backupModified;
+} PrimarySample;
+
+typedef struct {
+	PrimarySample x[MLT_DIMENSIONS];
+	// coordinates that have been read at all
+	uint32_t size;
+	uint32_t iteration;
+	uint32_t lastLarge;
+	int large;
+	// the next coordinate the path will read
+	uint32_t dimension;
+	// the chain's own generator, kept while other chains use the thread
+	uint32_t random;
+	// the path the chain is at and the pixel it lands on
+	Vector3 value;
+	float importance;
+	int pixel;
+	// mutations done so far and how many the current pass wants
+	long mutations;
+	long todo;
+} MltChain;
+
+_Thread_local MltChain *sampler_chain;
+
+float mlt_coordinate(MltChain *chain, uint32_t i) {
+	// paths this long just get fresh numbers
+	if (i >= MLT_DIMENSIONS)
+		return random_float();
+
+	PrimarySample *x = &chain->x[i];
+	if (i >= chain->size) {
+		chain->size = i + 1;
+		x->value = random_float();
+		x->value -= floorf(x->value);
+		x->modified = chain->iteration;
+		x->backup = x->value;
+		x->backupModified = chain->iteration - 1;
+		return x->value;
+	}
+
+	if (x->modified < chain->lastLarge) {
+		x->value = random_float();
+		x->modified = chain->lastLarge;
+	}
+	x->backup = x->value;
+	x->backupModified = x->modified;
+	if (chain->large) {
+		x->value = random_float();
+	} else {
+		// the small steps since it was last read add up to one wider one
+		float r = sqrtf(-2.0f * logf(fmaxf(random_float(), 1e-12f)));
+		float normal = r * cosf(2.0f * (float)M_PI * random_float());
+		x->value += normal * MLT_SIGMA * sqrtf((float)(chain->iteration - x->modified));
+	}
+	x->value -= floorf(x->value);
+	x->modified = chain->iteration;
+	return x->value;
+}
+
+void mlt_start_iteration(MltChain *chain) {
+	chain->iteration += 1;
+	chain->large = random_float() < MLT_LARGE_STEP;
+	chain->dimension = 0;
+}
+
+void mlt_accept(MltChain *chain) {
+	if (chain->large)
+		chain->lastLarge = chain->iteration;
+}
+
+void mlt_reject(MltChain *chain) {
+	for (uint32_t i = 0; i < chain->size; ++i) {
+		PrimarySample *x = &chain->x[i];
+		if (x->modified == chain->iteration) {
+			x->value = x->backup;
+			x->modified = x->backupModified;
+		}
+	}
+	chain->iteration -= 1;
+}
+
+// the next decision's count (at most SOBOL_DIMENSIONS) coordinates in [0, 1)
+void sampler_next(float *u, int count) {
+	int stage = profile_enter(STAGE_RNG);
+	if (sampler_chain) {
+		for (int d = 0; d < count; ++d)
+			u[d] = mlt_coordinate(sampler_chain, sampler_chain->dimension++);
+		profile_leave(stage);
+		return;
+	}
+	uint32_t dimension = sampler_dimension++;
+	uint32_t seed = hash_mix(hash_mix(blue_noise ? 0 : sampler_pixel, dimension), render_seed);
+	uint32_t index = owen_scramble(sampler_sample, seed);
+	// sobol points are the xor of a direction number per set bit
+	uint32_t x[SOBOL_DIMENSIONS] = {0};
+	for (uint32_t bits = index; bits; bits &= bits - 1) {
+		const int bit = __builtin_ctz(bits);
+		for (int d = 0; d < count; ++d)
+			x[d] ^= sobol_directions[d][bit];
+	}
+	for (int d = 0; d < count; ++d) {
+		x[d] = owen_scramble(x[d], hash_mix(seed, d + 1));
+		if (blue_noise)
+			x[d] ^= blue_noise_shift(sampler_x, sampler_y, dimension * SOBOL_DIMENSIONS + d);
+		// 24 bits are all a float can hold
+		u[d] = (float)(x[d] >> 8) * (1.0f / 16777216.0f);
+	}
+	profile_leave(stage);
+}
+
+// float only approximations for the hot paths, next to libm's double
+// versions they would otherwise go through. each states its worst
+// relative error over the inputs it is meant for and --check-math
+// measures them against libm. nothing switches over wholesale, a call
+// site opts in by calling these instead
+
+typedef union {
+	float f;
+	uint32_t u;
+} FloatBits;
+
+// 1 / sqrt(x) for positive normal x, within 5e-6
+static inline float fast_rsqrt(float x) {
+	FloatBits bits = {x};
+	bits.u = 0x5f375a86u - (bits.u >> 1);
+	float y = bits.f;
+	// two newton steps, each squares the error of the guess
+	y = y * (1.5f - 0.5f * x * y * y);
+	y = y * (1.5f - 0.5f * x * y * y);
+	return y;
+}
+
+// x^5, within 3 float roundings (3e-7)
+static inline float fast_pow5(float x) {
+	float x2 = x * x;
+	return x2 * x2 * x;
+}
+
+// log2(x) for positive normal x, within 2e-7 absolute
+static inline float fast_log2(float x) {
+	FloatBits bits = {x};
+	// x = m * 2^e with m in [sqrt(1/2), sqrt(2)) so the polynomial is
+	// short. measuring the bits from sqrt(1/2)'s picks e without a branch
+	uint32_t offset = bits.u - 0x3f3504f3u;
+	int e = (int32_t)offset >> 23;
+	bits.u = (offset & 0x007fffffu) + 0x3f3504f3u;
+	// least squares fit of log2(1 + t) / t over the mantissa's range, no
+	// division and short enough to stay ahead of log2f
+	float t = bits.f - 1.0f;
+	float p = 1.44269496f + t * (-0.721352759f + t * (0.480924039f + t * (-0.360241986f
+		+ t * (0.287075611f + t * (-0.248821807f + t * (0.23420985f + t * -0.146203527f))))));
+	return (float)e + t * p;
+}
+
+// 2^x, within 3e-7 for x in [-126, 127.4], clamped outside
+static inline float fast_exp2(float x) {
+	x = x < -126.0f ? -126.0f : x > 127.4f ? 127.4f : x;
+	// 2^x = 2^i * 2^f with |f| <= 1/2, x is positive before the
+	// truncation so it rounds to nearest without calling floorf
+	int i = (int)(x + 126.5f) - 126;
+	float f = x - (float)i;
+	// least squares fit of 2^f
+	float p = 1.00000008f + f * (0.693147207f + f * (0.240221074f + f * (0.0555032721f
+		+ f * (0.0096760371f + f * 0.00134004322f))));
+	FloatBits bits;
+	bits.u = (uint32_t)(i + 127) << 23;
+	return p * bits.f;
+}
+
+// e^x within 6e-6 for x in [-87, 88], the rounding of x log2(e) grows
+// with |x|, and log(x) within 2e-7 absolute
+static inline float fast_exp(float x) {
+	return fast_exp2(x * 1.44269504f);
+}
+
+static inline float fast_log(float x) {
+	return fast_log2(x) * 0.693147181f;
+}
+
+// x^y for positive x, the error of fast_log2 grows by |y log(x)|
+static inline float fast_pow(float x, float y) {
+	return fast_exp2(y * fast_log2(x));
+}
+
+// display gamma for 0 <= x <= 1, within 1e-6 absolute; zero and
+// denormals go to 0, as they all round to a black pixel anyway
+static inline float fast_gamma(float x) {
+	return x < 1e-30f ? 0.0f : fast_pow(x, 1.0f / 2.2f);
+}
+
 Vector3 vector3_all(float a) {
 	Vector3 result;
 	result.x = a;
@@ -101,16 +747,31 @@ Vector3 vector3_normalized(Vector3 a) {
 	return result;
 }
 
+// like vector3_normalized through fast_rsqrt, for the directions that are
+// made up on every bounce
+Vector3 vector3_normalized_fast(Vector3 a) {
+	Vector3 result = {1.0f, 0.0f, 0.0f};
+	float lengthSquared = vector3_dot_product(a, a);
+	if (lengthSquared > 1e-30f)
+		result = vector3_scale(a, vector3_all(fast_rsqrt(lengthSquared)));
+	return result;
+}
+
+// a direction from the next sampler dimensions, through a point in the cube
 Vector3 vector3_random_unit_vector() {
 	Vector3 result;
-	result.x = 2.0 * random_float() - 1.0;
-	result.y = 2.0 * random_float() - 1.0;
-	result.z = 2.0 * random_float() - 1.0;
-	result = vector3_normalized(result);
+	float u[3];
+	sampler_next(u, 3);
+	result.x = 2.0f * u[0] - 1.0f;
+	result.y = 2.0f * u[1] - 1.0f;
+	result.z = 2.0f * u[2] - 1.0f;
+	result = vector3_normalized_fast(result);
 	return result;
 }
 
-float line_sphere_intersect(Line line, Sphere sphere) {
+// nearest root, or the far one when the near one is behind a ray that
+// starts inside a dielectric, since that is where it gets out
+float line_sphere_intersect(Line line, Sphere sphere, const Material *materials) {
 	float result;
 	
 	Vector3 d = vector3_subtract(line.origin, sphere.center);
@@ -119,9 +780,11 @@ float line_sphere_intersect(Line line, Sphere sphere) {
 	float C = vector3_dot_product(d, d) - sphere.radius * sphere.radius;
 	float Delta = halfB * halfB - C;
 	
-	if (Delta >= 0.0)
+	if (Delta >= 0.0) {
 		result = - halfB - sqrt(halfB * halfB - C);
-	else
+		if (result <= 0.000001 && materials[sphere.material].kind == MATERIAL_DIELECTRIC)
+			result = - halfB + sqrt(halfB * halfB - C);
+	} else
 		result = -1.0;
 	
 	return result;
@@ -129,32 +792,24 @@ float line_sphere_intersect(Line line, Sphere sphere) {
 
 float D_GGX(float NoH, float a) {
     float a2 = a * a;
-    float f = (NoH * a2 - NoH) * NoH + 1.0;
-    return a2 / (M_PI * f * f);
+    float f = (NoH * a2 - NoH) * NoH + 1.0f;
+    return a2 / ((float)M_PI * f * f);
 }
 
 float V_SmithGGXCorrelatedFast(float NoV, float NoL, float roughness) {
     float a = roughness;
-    float GGXV = NoL * (NoV * (1.0 - a) + a);
-    float GGXL = NoV * (NoL * (1.0 - a) + a);
-    return 0.5 / (GGXV + GGXL);
+    float GGXV = NoL * (NoV * (1.0f - a) + a);
+    float GGXL = NoV * (NoL * (1.0f - a) + a);
+    return 0.5f / (GGXV + GGXL);
 }
 
 Vector3 F_Schlick(float u, Vector3 f0) {
-	return vector3_add(f0, vector3_scale(vector3_subtract(vector3_all(1.0), f0), vector3_all(pow(1.0 - u, 5.0))));
+	return vector3_add(f0, vector3_scale(vector3_subtract(vector3_all(1.0), f0), vector3_all(fast_pow5(1.0f - u))));
 }
 
-Vector3 reflectance_function(
-	Vector3 incoming, 
-	Vector3 outgoing, 
-	Vector3 normal, 
-	Vector3 baseColor, 
-	float metallic,
-	float perceptualRoughness) 
-{
-	Vector3 result;
-
-	Vector3 halfway = vector3_normalized(vector3_add(incoming, outgoing));
+// the specular lobe, f0 is the reflectance head on
+Vector3 cook_torrance(Vector3 incoming, Vector3 outgoing, Vector3 normal, Vector3 f0, float perceptualRoughness) {
+	Vector3 halfway = vector3_normalized_fast(vector3_add(incoming, outgoing));
 	float NdotH = vector3_dot_product(normal, halfway);
 	float NdotI = vector3_dot_product(normal, incoming);
 	float NdotR = vector3_dot_product(normal, outgoing);
@@ -177,20 +832,175 @@ Vector3 reflectance_function(
 	HdotR = 0.0 < HdotR ? HdotR : -HdotR;
 
 	float roughness = perceptualRoughness * perceptualRoughness;
-	Vector3 f0 = vector3_add(vector3_all(0.04 * (1.0 - metallic)), vector3_scale(baseColor, vector3_all(metallic)));
 
 	float D = D_GGX(NdotH, roughness);
 	float V = V_SmithGGXCorrelatedFast(NdotR, NdotI, roughness);
 	Vector3 F = F_Schlick(HdotR, f0);
 
-	Vector3 cookTorrance = vector3_scale(F, vector3_all((D * V) / (M_PI * NdotI * NdotR)));
-	Vector3 lambertian = vector3_scale(baseColor, vector3_all((1.0 - metallic) * M_1_PI));
+	return vector3_scale(F, vector3_all((D * V) / ((float)M_PI * NdotI * NdotR)));
+}
+
+Vector3 reflectance_function(
+	Vector3 incoming, 
+	Vector3 outgoing, 
+	Vector3 normal, 
+	Vector3 baseColor, 
+	float metallic,
+	float perceptualRoughness) 
+{
+	Vector3 result;
+
+	Vector3 f0 = vector3_add(vector3_all(0.04f * (1.0f - metallic)), vector3_scale(baseColor, vector3_all(metallic)));
+
+	Vector3 cookTorrance = cook_torrance(incoming, outgoing, normal, f0, perceptualRoughness);
+	Vector3 lambertian = vector3_scale(baseColor, vector3_all((1.0f - metallic) * (float)M_1_PI));
 
 	result = vector3_add(lambertian, cookTorrance);
 
 	return result;
 }
 
+// the direction at cosine z to normal and angle phi around it
+Vector3 vector3_around(Vector3 normal, float z, float phi) {
+	float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+
+	// a tangent frame without branches (duff et al. 2017)
+	float sign = copysignf(1.0f, normal.z);
+	float a = -1.0f / (sign + normal.z);
+	float b = normal.x * normal.y * a;
+	Vector3 tangent = {1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+	Vector3 bitangent = {b, sign + normal.y * normal.y * a, -normal.y};
+
+	Vector3 result = vector3_scale(normal, vector3_all(z));
+	result = vector3_add(result, vector3_scale(tangent, vector3_all(r * cosf(phi))));
+	result = vector3_add(result, vector3_scale(bitangent, vector3_all(r * sinf(phi))));
+	return result;
+}
+
+// uniform over the hemisphere around normal. the cosine to the normal
+// takes the first sampler coordinate and the angle around it the second,
+// so what a bounce sees depends mostly on one well distributed number
+Vector3 vector3_random_hemisphere(Vector3 normal) {
+	float u[2];
+	sampler_next(u, 2);
+	return vector3_around(normal, u[0], 2.0f * (float)M_PI * u[1]);
+}
+
+// a mirror direction blurred by roughness
+Vector3 vector3_rough(Vector3 direction, float perceptualRoughness) {
+	float roughness = perceptualRoughness * perceptualRoughness;
+	if (roughness == 0.0f)
+		return direction;
+	return vector3_normalized(vector3_add(direction, vector3_scale(vector3_random_unit_vector(), vector3_all(roughness))));
+}
+
+// the brdf of the classes that have no delta lobes
+static inline __attribute__((always_inline))
+Vector3 material_brdf(int kind, const Material *material, Vector3 incoming, Vector3 outgoing, Vector3 normal) {
+	if (kind == MATERIAL_DIFFUSE)
+		return vector3_scale(material->color, vector3_all((float)M_1_PI));
+	if (kind == MATERIAL_METAL)
+		return cook_torrance(incoming, outgoing, normal, material->color, material->roughness);
+	return reflectance_function(incoming, outgoing, normal, material->color, material->metallic, material->roughness);
+}
+
+Vector3 material_eval(const Material *material, Vector3 incoming, Vector3 outgoing, Vector3 normal) {
+	switch (material->kind) {
+	case MATERIAL_DIFFUSE:
+		return material_brdf(MATERIAL_DIFFUSE, material, incoming, outgoing, normal);
+	case MATERIAL_METAL:
+		return material_brdf(MATERIAL_METAL, material, incoming, outgoing, normal);
+	default:
+		return material_brdf(MATERIAL_LAYERED, material, incoming, outgoing, normal);
+	}
+}
+
+// schlick's reflectance of a dielectric seen at cosOut on the side eta
+// belongs to, k goes negative under total internal reflection
+static inline float dielectric_fresnel(const Material *material, float cosOut, float eta, float *k) {
+	float r0 = (1.0f - material->ior) / (1.0f + material->ior);
+	r0 = r0 * r0;
+	float m = 1.0f - cosOut;
+	*k = 1.0f - eta * eta * (1.0f - cosOut * cosOut);
+	return r0 + (1.0f - r0) * (m * m) * (m * m) * m;
+}
+
+// pick the next direction of a path off a surface. returns the brdf and
+// sets the cosine it gets weighted with. outgoing points back along the
+// path. hemisphere lobes are sampled uniformly and, as the tracer always
+// has, left without the constant 1 / pdf; the dielectric's mirror and
+// refraction lobes are deltas that return their weight with a cosine of 1
+// and set *delta. kind is a constant at every call, so each class gets
+// its own copy with only the lobes it has, no branches, pow or normalize
+// it doesn't need
+static inline __attribute__((always_inline))
+Vector3 material_kernel(int kind, const Material *material, Vector3 outgoing, Vector3 normal,
+	Vector3 *incoming, float *cosine, int *delta)
+{
+	*delta = 0;
+	if (kind == MATERIAL_DIELECTRIC) {
+		profile_stage = STAGE_SAMPLING;
+		float cosOut = vector3_dot_product(normal, outgoing);
+		float eta = 1.0f / material->ior;
+		if (cosOut < 0.0f) {
+			normal = vector3_scale(normal, vector3_all(-1.0));
+			cosOut = -cosOut;
+			eta = material->ior;
+		}
+
+		float k;
+		float fresnel = dielectric_fresnel(material, cosOut, eta, &k);
+
+		// both choices come from one sampler group so they stratify together
+		float u[2];
+		sampler_next(u, 2);
+		*cosine = 1.0f;
+		*delta = 1;
+		if (k < 0.0f || u[0] < fresnel) {
+			Vector3 mirror = vector3_subtract(vector3_scale(normal, vector3_all(2.0f * cosOut)), outgoing);
+			*incoming = vector3_rough(mirror, material->roughness);
+			return vector3_all(1.0);
+		}
+		if (u[1] < material->transmission) {
+			Vector3 refracted = vector3_subtract(vector3_scale(normal, vector3_all(eta * cosOut - sqrtf(k))),
+				vector3_scale(outgoing, vector3_all(eta)));
+			*incoming = vector3_rough(refracted, material->roughness);
+			return material->color;
+		}
+		// what neither reflects nor goes through scatters diffusely
+		*delta = 0;
+		*incoming = vector3_random_hemisphere(normal);
+		*cosine = vector3_dot_product(*incoming, normal);
+		return vector3_scale(material->color, vector3_all((float)M_1_PI));
+	}
+
+	profile_stage = STAGE_SAMPLING;
+	*incoming = vector3_random_hemisphere(normal);
+
+	profile_stage = STAGE_BRDF;
+	*cosine = vector3_dot_product(*incoming, normal);
+	return material_brdf(kind, material, *incoming, outgoing, normal);
+}
+
+Vector3 material_sample(const Material *material, Vector3 outgoing, Vector3 normal, Vector3 *incoming, float *cosine,
+	int *delta)
+{
+	switch (material->kind) {
+	case MATERIAL_DIFFUSE:
+		return material_kernel(MATERIAL_DIFFUSE, material, outgoing, normal, incoming, cosine, delta);
+	case MATERIAL_METAL:
+		return material_kernel(MATERIAL_METAL, material, outgoing, normal, incoming, cosine, delta);
+	case MATERIAL_DIELECTRIC:
+		return material_kernel(MATERIAL_DIELECTRIC, material, outgoing, normal, incoming, cosine, delta);
+	default:
+		return material_kernel(MATERIAL_LAYERED, material, outgoing, normal, incoming, cosine, delta);
+	}
+}
+
+int material_emits(const Material *material) {
+	return material->emission.x > 0.0f || material->emission.y > 0.0f || material->emission.z > 0.0f;
+}
+
 
 #define red (Vector3){1.0, 0.0, 0.0}
 #define green (Vector3){0.0, 1.0, 0.0}
@@ -199,110 +1009,5030 @@ Vector3 reflectance_function(
 #define black (Vector3){0.0, 0.0, 0.0}
 #define skyblue (Vector3){0.529412, 0.807843, 0.921569}
 
-#define SPHERE_COUNT 2
-Sphere spheres[SPHERE_COUNT] = {{red, (Vector3){0.0, 1.0, 0.0}, 1.0}, {green, (Vector3){0.0, -10.0, 0.0}, 10.0}};
+Material default_materials[] = {{MATERIAL_METAL, red, 1.0, 0.2}, {MATERIAL_METAL, green, 1.0, 0.2}};
+Sphere default_spheres[] = {{(Vector3){0.0, 1.0, 0.0}, 1.0, 0}, {(Vector3){0.0, -10.0, 0.0}, 10.0, 1}};
 
+Camera camera_look_at(Vector3 origin, Vector3 target, float scale) {
+	Camera result;
+	result.origin = origin;
+	result.forward = vector3_normalized(vector3_subtract(target, origin));
+	result.right = vector3_normalized(vector3_cross_product(result.forward, (Vector3){0.0, 1.0, 0.0}));
+	result.up = vector3_cross_product(result.right, result.forward);
+	result.scale = scale;
+	return result;
+}
 
-Vector3 ray_trace(Line ray) {
-	Vector3 color = {1.0, 1.0, 1.0};
-	// incident
-	Vector3 incomingRay;
-	// reflected
-	Vector3 outgoingRay;
-	// surface
-	Vector3 surfaceNormal;
-	Vector3 surfacePoint;
-	Vector3 surfaceColor;
-	float surfaceRoughness;
-	float surfaceMetallic;
-	float surfaceIOR;
+Vector3 transform_point(const Transform *t, Vector3 p) {
+	Vector3 result;
+	result.x = t->m[0][0] * p.x + t->m[0][1] * p.y + t->m[0][2] * p.z + t->m[0][3];
+	result.y = t->m[1][0] * p.x + t->m[1][1] * p.y + t->m[1][2] * p.z + t->m[1][3];
+	result.z = t->m[2][0] * p.x + t->m[2][1] * p.y + t->m[2][2] * p.z + t->m[2][3];
+	return result;
+}
 
-	for (int bounce = 0; bounce < BOUNCE_COUNT; ++bounce) {
+Vector3 transform_vector(const Transform *t, Vector3 v) {
+	Vector3 result;
+	result.x = t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z;
+	result.y = t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z;
+	result.z = t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z;
+	return result;
+}
 
-		float distance = 100000.0;
-		int hit = -1;
-		for (int i = 0; i < SPHERE_COUNT; ++i) {
-			float d  = line_sphere_intersect(ray, spheres[i]);
-			if (0.000001 < d && d < distance) {
-				distance = d;
-				hit = i;
-			}
-		}
+// normals go through the transpose of the inverse
+Vector3 transform_normal(const Transform *inverse, Vector3 n) {
+	Vector3 result;
+	result.x = inverse->m[0][0] * n.x + inverse->m[1][0] * n.y + inverse->m[2][0] * n.z;
+	result.y = inverse->m[0][1] * n.x + inverse->m[1][1] * n.y + inverse->m[2][1] * n.z;
+	result.z = inverse->m[0][2] * n.x + inverse->m[1][2] * n.y + inverse->m[2][2] * n.z;
+	return result;
+}
 
-		if (hit < 0) {
-			color = vector3_scale(color, skyblue);
-			break;
+// translate * rotate * scale, and its inverse worked out directly
+void instance_place(Instance *instance, Vector3 position, float yaw, Vector3 scale) {
+	instance->position = position;
+	instance->yaw = yaw;
+	instance->scale = scale;
+
+	float c = cosf(yaw * M_PI / 180.0), s = sinf(yaw * M_PI / 180.0);
+	float rotation[3][3] = {{c, 0.0, s}, {0.0, 1.0, 0.0}, {-s, 0.0, c}};
+	float factors[3] = {scale.x, scale.y, scale.z};
+	float offset[3] = {position.x, position.y, position.z};
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			instance->toWorld.m[i][j] = rotation[i][j] * factors[j];
+			instance->toObject.m[i][j] = rotation[j][i] / factors[i];
 		}
+		instance->toWorld.m[i][3] = offset[i];
+	}
+	for (int i = 0; i < 3; ++i)
+		instance->toObject.m[i][3] = -(instance->toObject.m[i][0] * offset[0]
+			+ instance->toObject.m[i][1] * offset[1] + instance->toObject.m[i][2] * offset[2]);
+}
 
-		float cosTheta;
-		Vector3 brdf;
+// a scene is its spheres, the objects it places as instances and the
+// camera it is meant to be seen from. the renderer works on whatever the
+// globals below point at
+typedef struct {
+	char path[4096];
+	time_t modified;
+	Sphere *spheres;
+	int sphereCount;
+	Object *objects;
+	int objectCount;
+	Sphere *objectSpheres;
+	int objectSphereCount;
+	Instance *instances;
+	int instanceCount;
+	Material *materials;
+	int materialCount;
+	Camera camera;
+	// the trees over it, built once when it is loaded
+	Bvh sphereBvh;
+	Box *sphereBoxes;
+	Bvh *objectBvhs;
+	Box *objectSphereBoxes;
+	Bvh instanceBvh;
+	Box *instanceBoxes;
+} Scene;
 
-		surfacePoint = vector3_add(ray.origin, vector3_scale(ray.direction, vector3_all(distance)));
-		surfaceNormal = vector3_normalized(vector3_subtract(surfacePoint, spheres[hit].center));
-		surfaceColor = spheres[hit].color;
-		surfaceMetallic = 1.0;
-		surfaceRoughness = 0.2;
+Material *materials = default_materials;
+int material_count = sizeof(default_materials) / sizeof(default_materials[0]);
+Sphere *spheres = default_spheres;
+int sphere_count = sizeof(default_spheres) / sizeof(default_spheres[0]);
+Object *objects;
+int object_count;
+Sphere *object_spheres;
+int object_sphere_count;
+Instance *instances;
+int instance_count;
+Camera camera;
+// the scene's trees. each object has its own, over its spheres in object
+// space, and the top level tree holds the instances' world space boxes, so
+// memory grows with the unique geometry and moving an instance only
+// touches the top level
+Bvh *sphere_bvh;
+Box *sphere_boxes;
+Bvh *object_bvhs;
+Bvh *instance_bvh;
+Box *instance_boxes;
 
-		outgoingRay = vector3_scale(ray.direction, vector3_all(-1.0));
+void scene_use(Scene *scene) {
+	materials = scene->materials;
+	material_count = scene->materialCount;
+	spheres = scene->spheres;
+	sphere_count = scene->sphereCount;
+	objects = scene->objects;
+	object_count = scene->objectCount;
+	object_spheres = scene->objectSpheres;
+	object_sphere_count = scene->objectSphereCount;
+	instances = scene->instances;
+	instance_count = scene->instanceCount;
+	camera = scene->camera;
+	sphere_bvh = &scene->sphereBvh;
+	sphere_boxes = scene->sphereBoxes;
+	object_bvhs = scene->objectBvhs;
+	instance_bvh = &scene->instanceBvh;
+	instance_boxes = scene->instanceBoxes;
+}
 
-		incomingRay = vector3_random_unit_vector();
-		if (vector3_dot_product(incomingRay, surfaceNormal) < 0.0)
-			incomingRay = vector3_scale(incomingRay, vector3_all(-1.0));
+// the sphere a hit is on, wherever it is stored
+Sphere *hit_sphere(Hit hit) {
+	return hit.instance < 0 ? &spheres[hit.sphere] : &object_spheres[hit.sphere];
+}
 
-		cosTheta = vector3_dot_product(incomingRay, surfaceNormal);
-		brdf = reflectance_function(
-			incomingRay, outgoingRay, surfaceNormal, surfaceColor, surfaceMetallic, surfaceRoughness
-		);
+Scene scene_default() {
+	Scene result;
+	memset(&result, 0, sizeof(result));
+	snprintf(result.path, sizeof(result.path), "default");
+	result.materials = default_materials;
+	result.materialCount = sizeof(default_materials) / sizeof(default_materials[0]);
+	result.spheres = default_spheres;
+	result.sphereCount = sizeof(default_spheres) / sizeof(default_spheres[0]);
+	result.camera = camera_look_at((Vector3){0.0, 1.0, 5.0}, (Vector3){0.0, 1.0, 4.0}, 0.5);
+	return result;
+}
 
-		ray.origin = surfacePoint;
-		ray.direction = incomingRay;
+// "x y z [yaw [sx [sy sz]]]", a single scale is uniform
+int placement_parse(const char *text, Vector3 *position, float *yaw, Vector3 *scale) {
+	*yaw = 0.0;
+	*scale = vector3_all(1.0);
+	int n = sscanf(text, "%f %f %f %f %f %f %f", &position->x, &position->y, &position->z, yaw,
+		&scale->x, &scale->y, &scale->z);
+	if (n == 5)
+		scale->y = scale->z = scale->x;
+	return (n == 3 || n == 4 || n == 5 || n == 7) && scale->x != 0.0 && scale->y != 0.0 && scale->z != 0.0;
+}
 
-		// brdf * light * cosTheta;
-		color  = vector3_scale(vector3_scale(color, brdf), vector3_all(cosTheta));
-		// color  = brdf;
+// grow an array by one element when it is full
+void *array_reserve(void *array, int count, int *capacity, size_t size) {
+	if (count < *capacity)
+		return array;
+	*capacity = *capacity ? *capacity * 2 : 16;
+	array = realloc(array, *capacity * size);
+	assert(array);
+	return array;
+}
+
+const char *material_kinds[MATERIAL_CLASS_COUNT] = {"diffuse", "metal", "dielectric", "layered"};
+
+// everything after a material's name, see scene_load
+int material_parse(const char *text, Material *material) {
+	char kind[32];
+	int offset = 0, n;
+	memset(material, 0, sizeof(*material));
+	material->ior = 1.0;
+	if (sscanf(text, "%31s %n", kind, &offset) != 1)
+		return 0;
+	material->kind = -1;
+	for (int i = 0; i < MATERIAL_CLASS_COUNT; ++i)
+		if (!strcmp(kind, material_kinds[i]))
+			material->kind = i;
+
+	Vector3 *c = &material->color;
+	float f[3];
+	int used = 0;
+	switch (material->kind) {
+	case MATERIAL_DIFFUSE:
+		n = sscanf(text + offset, "%f %f %f %n", &c->x, &c->y, &c->z, &used) == 3;
+		break;
+	case MATERIAL_METAL:
+		material->metallic = 1.0;
+		n = sscanf(text + offset, "%f %f %f %f %n", &c->x, &c->y, &c->z, &material->roughness, &used) == 4;
+		break;
+	case MATERIAL_DIELECTRIC:
+		material->transmission = 1.0;
+		n = sscanf(text + offset, "%f %f %f %f %f %n", &c->x, &c->y, &c->z, &material->roughness, &material->ior, &used) == 5;
+		int more = 0;
+		if (n && sscanf(text + offset + used, "%f %n", &f[0], &more) == 1) {
+			material->transmission = f[0];
+			used += more;
+		}
+		n = n && material->ior > 0.0;
+		break;
+	case MATERIAL_LAYERED:
+		n = sscanf(text + offset, "%f %f %f %f %f %n", &c->x, &c->y, &c->z, &material->metallic, &material->roughness, &used) == 5;
+		break;
+	default:
+		return 0;
+	}
+	if (!n)
+		return 0;
+
+	text += offset + used;
+	if (sscanf(text, "%31s %n", kind, &offset) == 1) {
+		if (strcmp(kind, "emit") || sscanf(text + offset, "%f %f %f %n", &f[0], &f[1], &f[2], &used) != 3)
+			return 0;
+		material->emission = (Vector3){f[0], f[1], f[2]};
+		if (sscanf(text + offset + used, "%31s", kind) == 1)
+			return 0;
 	}
+	return 1;
+}
 
-	return color;
+int material_find(Material *materials, int count, const char *name) {
+	for (int i = 0; i < count; ++i)
+		if (materials[i].name[0] && !strcmp(materials[i].name, name))
+			return i;
+	return -1;
 }
 
-Color8 image[IMAGE_WIDTH * IMAGE_HEIGHT];
-int main() {
+// text scene files, one statement per line, # starts a comment:
+//   camera  x y z  target_x target_y target_z  vertical_fov_degrees
+//   material  name  diffuse  r g b                 [emit r g b]
+//             name  metal  r g b  roughness
+//             name  dielectric  r g b  roughness  ior  [transmission]
+//             name  layered  r g b  metallic roughness
+//   sphere  x y z  radius  material
+//   sphere  x y z  radius  r g b  [metallic roughness]
+//                         the second form makes up a metal, or a layered
+//                         material when metallic isn't 1
+//   object  name          spheres up to the next "end" make up an object,
+//   end                   in its own coordinates, that is only drawn
+//                         where it is instanced
+//   instance  name  x y z  [yaw_degrees [scale | scale_x scale_y scale_z]]
+int scene_load(const char *path, Scene *scene) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "could not open scene %s\n", path);
+		return 0;
+	}
+
+	*scene = scene_default();
+	snprintf(scene->path, sizeof(scene->path), "%s", path);
+	scene->spheres = NULL;
+	scene->sphereCount = 0;
+	scene->materials = NULL;
+	scene->materialCount = 0;
 
-	for (int y = 0; y < IMAGE_HEIGHT; ++y) {
- 		for (int x = 0; x < IMAGE_WIDTH; ++x) {
-			
-			Line ray;
-			ray.origin.x = 0.0;
-			ray.origin.y = 1.0;
-			ray.origin.z = 5.0;
-			ray.direction.x = (float)(x - (IMAGE_WIDTH / 2)) / IMAGE_HEIGHT;
-			ray.direction.y = (float)((IMAGE_HEIGHT / 2) - y) / IMAGE_HEIGHT;
-			ray.direction.z = -1.0;
-			ray.direction = vector3_normalized(ray.direction);
-			
-			Vector3 color = {0.0, 0.0, 0.0};
-			for (int i = 0; i < SAMPLE_COUNT; ++i) {
-				color = vector3_add(color, vector3_scale(ray_trace(ray), vector3_all(1.0 / (float)SAMPLE_COUNT)));
+	struct stat info;
+	if (fstat(fileno(file), &info) == 0)
+		scene->modified = info.st_mtime;
+
+	char line[1024];
+	int capacity = 0, objectCapacity = 0, objectSphereCapacity = 0, instanceCapacity = 0, materialCapacity = 0;
+	Object *object = NULL;
+	int ok = 1;
+	for (int number = 1; ok && fgets(line, sizeof(line), file); ++number) {
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char keyword[32], name[32];
+		Vector3 a, b;
+		float f, metallic = 1.0, roughness = 0.2;
+		int n, offset;
+		if (sscanf(line, "%31s", keyword) != 1)
+			continue;
+
+		if (!strcmp(keyword, "camera")
+			&& sscanf(line, "%*s %f %f %f %f %f %f %f", &a.x, &a.y, &a.z, &b.x, &b.y, &b.z, &f) == 7) {
+			scene->camera = camera_look_at(a, b, tan(f * M_PI / 360.0));
+		} else if (!strcmp(keyword, "material") && sscanf(line, "%*s %31s %n", name, &offset) == 1) {
+			Material material;
+			if (material_find(scene->materials, scene->materialCount, name) >= 0
+				|| !material_parse(line + offset, &material)) {
+				fprintf(stderr, "%s:%d: bad material \"%s\"\n", path, number, name);
+				ok = 0;
+				continue;
+			}
+			snprintf(material.name, sizeof(material.name), "%s", name);
+			scene->materials = array_reserve(scene->materials, scene->materialCount, &materialCapacity, sizeof(Material));
+			scene->materials[scene->materialCount++] = material;
+		} else if (!strcmp(keyword, "sphere") && sscanf(line, "%*s %f %f %f %f %n", &a.x, &a.y, &a.z, &f, &offset) == 4) {
+			Sphere sphere = {a, f, -1};
+			if ((n = sscanf(line + offset, "%f %f %f %f %f", &b.x, &b.y, &b.z, &metallic, &roughness)) == 3 || n == 5) {
+				Material material = {metallic == 1.0 ? MATERIAL_METAL : MATERIAL_LAYERED, b, metallic, roughness};
+				sphere.material = scene->materialCount;
+				scene->materials = array_reserve(scene->materials, scene->materialCount, &materialCapacity, sizeof(Material));
+				scene->materials[scene->materialCount++] = material;
+			} else if (sscanf(line + offset, "%31s", name) == 1) {
+				sphere.material = material_find(scene->materials, scene->materialCount, name);
 			}
+			if (sphere.material < 0) {
+				fprintf(stderr, "%s:%d: sphere has no material\n", path, number);
+				ok = 0;
+				continue;
+			}
+			if (object) {
+				scene->objectSpheres = array_reserve(scene->objectSpheres, scene->objectSphereCount,
+					&objectSphereCapacity, sizeof(Sphere));
+				scene->objectSpheres[scene->objectSphereCount++] = sphere;
+				object->count += 1;
+			} else {
+				scene->spheres = array_reserve(scene->spheres, scene->sphereCount, &capacity, sizeof(Sphere));
+				scene->spheres[scene->sphereCount++] = sphere;
+			}
+		} else if (!strcmp(keyword, "object") && !object && sscanf(line, "%*s %31s", name) == 1) {
+			scene->objects = array_reserve(scene->objects, scene->objectCount, &objectCapacity, sizeof(Object));
+			object = &scene->objects[scene->objectCount++];
+			snprintf(object->name, sizeof(object->name), "%s", name);
+			object->first = scene->objectSphereCount;
+			object->count = 0;
+		} else if (!strcmp(keyword, "end") && object && object->count) {
+			object = NULL;
+		} else if (!strcmp(keyword, "instance") && !object && sscanf(line, "%*s %31s %n", name, &offset) == 1) {
+			int found = -1;
+			for (int i = 0; i < scene->objectCount; ++i)
+				if (!strcmp(scene->objects[i].name, name))
+					found = i;
+			float yaw;
+			if (found < 0 || !placement_parse(line + offset, &a, &yaw, &b)) {
+				fprintf(stderr, "%s:%d: bad instance of \"%s\"\n", path, number, name);
+				ok = 0;
+				continue;
+			}
+			scene->instances = array_reserve(scene->instances, scene->instanceCount, &instanceCapacity, sizeof(Instance));
+			Instance *instance = &scene->instances[scene->instanceCount++];
+			instance->object = found;
+			instance_place(instance, a, yaw, b);
+		} else {
+			fprintf(stderr, "%s:%d: can't parse \"%s\"\n", path, number, keyword);
+			ok = 0;
+		}
+	}
+	fclose(file);
+
+	if (ok && object) {
+		fprintf(stderr, "%s: object \"%s\" has no end\n", path, object->name);
+		ok = 0;
+	}
+	if (!ok) {
+		free(scene->materials);
+		scene->materials = NULL;
+		free(scene->spheres);
+		free(scene->objects);
+		free(scene->objectSpheres);
+		free(scene->instances);
+		scene->spheres = NULL;
+		scene->objects = NULL;
+		scene->objectSpheres = NULL;
+		scene->instances = NULL;
+	}
+	return ok;
+}
+
+void scene_free(Scene *scene) {
+	if (scene->materials != default_materials)
+		free(scene->materials);
+	scene->materials = NULL;
+	if (scene->spheres != default_spheres)
+		free(scene->spheres);
+	free(scene->objects);
+	free(scene->objectSpheres);
+	free(scene->instances);
+	scene->spheres = NULL;
+	scene->objects = NULL;
+	scene->objectSpheres = NULL;
+	scene->instances = NULL;
 
+	bvh_free(&scene->sphereBvh);
+	for (int i = 0; scene->objectBvhs && i < scene->objectCount; ++i)
+		bvh_free(&scene->objectBvhs[i]);
+	bvh_free(&scene->instanceBvh);
+	free(scene->sphereBoxes);
+	free(scene->objectBvhs);
+	free(scene->objectSphereBoxes);
+	free(scene->instanceBoxes);
+	scene->sphereBoxes = NULL;
+	scene->objectBvhs = NULL;
+	scene->objectSphereBoxes = NULL;
+	scene->instanceBoxes = NULL;
+}
 
-			color.x = color.x / (color.x + 1.0);
-			color.y = color.y / (color.y + 1.0);
-			color.z = color.z / (color.z + 1.0);
+// 64 bit fnv-1a
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *p = data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
 
-			color.x = pow(color.x, 1.0 / 2.2);
-			color.y = pow(color.y, 1.0 / 2.2);
-			color.z = pow(color.z, 1.0 / 2.2);
+#define HASH_SEED 0xcbf29ce484222325ull
 
-			Color8 pixel;
-			pixel.r = 0.0 < color.x ? color.x < 1.0 ? (uint8_t)(255.0 * color.x) : 255 : 0;
-			pixel.g = 0.0 < color.y ? color.y < 1.0 ? (uint8_t)(255.0 * color.y) : 255 : 0;
-			pixel.b = 0.0 < color.z ? color.z < 1.0 ? (uint8_t)(255.0 * color.z) : 255 : 0;
+// --photons and --photon-radius, the photon map itself comes later
+#define PHOTON_RADIUS 0.05
+int photon_emit = 0;
+float photon_radius = PHOTON_RADIUS;
 
-			image[y * IMAGE_WIDTH + x] = pixel;
+// what a frame looks like apart from its size: the materials, the
+// spheres, the placed objects, the camera and the seed
+uint64_t frame_hash() {
+	uint64_t hash = HASH_SEED;
+	// names don't change the picture
+	for (int i = 0; i < material_count; ++i)
+		hash = hash_bytes(hash, &materials[i], offsetof(Material, name));
+	hash = hash_bytes(hash, spheres, sphere_count * sizeof(Sphere));
+	if (instance_count) {
+		for (int i = 0; i < object_count; ++i) {
+			hash = hash_bytes(hash, &objects[i].first, sizeof(objects[i].first));
+			hash = hash_bytes(hash, &objects[i].count, sizeof(objects[i].count));
 		}
+		hash = hash_bytes(hash, object_spheres, object_sphere_count * sizeof(Sphere));
+		hash = hash_bytes(hash, instances, instance_count * sizeof(Instance));
+	}
+	hash = hash_bytes(hash, &camera, sizeof(camera));
+	hash = hash_bytes(hash, &render_seed, sizeof(render_seed));
+	if (blue_noise)
+		hash = hash_bytes(hash, &blue_noise, sizeof(blue_noise));
+	if (photon_emit) {
+		hash = hash_bytes(hash, &photon_emit, sizeof(photon_emit));
+		hash = hash_bytes(hash, &photon_radius, sizeof(photon_radius));
 	}
+	return hash;
+}
 
-	stbi_write_png("image/image.png", IMAGE_WIDTH, IMAGE_HEIGHT, 3, image, 0);
-	return 0;
+
+// hardware performance counters (--counters), opened per thread through
+// perf_event_open and attributed to whichever phase the thread is in
+enum { PHASE_INTERSECT, PHASE_SHADE, PHASE_POST, PHASE_COUNT };
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, COUNTER_COUNT };
+
+const char *phase_names[PHASE_COUNT] = {"intersect", "shade", "post-process"};
+
+typedef struct {
+	int fds[COUNTER_COUNT];
+	struct perf_event_mmap_page *pages[COUNTER_COUNT];
+	uint64_t last[COUNTER_COUNT];
+	int phase;
+} CounterThread;
+
+int counters_enabled = 0;
+int counters_available[COUNTER_COUNT];
+uint64_t counter_totals[PHASE_COUNT][COUNTER_COUNT];
+uint64_t counter_rays;
+pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local CounterThread counter_thread;
+_Thread_local uint64_t counter_thread_totals[PHASE_COUNT][COUNTER_COUNT];
+_Thread_local uint64_t counter_thread_rays;
+
+int counter_open(int counter) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	switch (counter) {
+	case COUNTER_CYCLES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case COUNTER_INSTRUCTIONS:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case COUNTER_L1D_MISSES:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+	case COUNTER_LLC_MISSES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case COUNTER_BRANCH_MISSES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	}
+
+	// pid 0, cpu -1: count this thread wherever it runs
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t counter_read(int counter) {
+	struct perf_event_mmap_page *page = counter_thread.pages[counter];
+	uint64_t value = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	// rdpmc straight from user space is ~30x cheaper than a read() syscall,
+	// which matters since we switch phase on every bounce
+	if (page) {
+		uint32_t seq, index;
+		int ok;
+		do {
+			seq = page->lock;
+			__asm__ volatile("" ::: "memory");
+			index = page->index;
+			value = page->offset;
+			ok = page->cap_user_rdpmc && index;
+			if (ok) {
+				uint32_t lo, hi;
+				__asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+				int64_t pmc = (int64_t)(((uint64_t)hi << 32) | lo);
+				pmc <<= 64 - page->pmc_width;
+				pmc >>= 64 - page->pmc_width;
+				value += pmc;
+			}
+			__asm__ volatile("" ::: "memory");
+		} while (page->lock != seq);
+		if (ok)
+			return value;
+	}
+#endif
+
+	if (read(counter_thread.fds[counter], &value, sizeof(value)) != sizeof(value))
+		value = 0;
+	return value;
+}
+
+void counters_phase(int phase) {
+	if (!counters_enabled)
+		return;
+
+	for (int c = 0; c < COUNTER_COUNT; ++c) {
+		if (counter_thread.fds[c] < 0)
+			continue;
+		uint64_t value = counter_read(c);
+		if (counter_thread.phase >= 0)
+			counter_thread_totals[counter_thread.phase][c] += value - counter_thread.last[c];
+		counter_thread.last[c] = value;
+	}
+
+	if (phase == PHASE_INTERSECT)
+		counter_thread_rays++;
+	counter_thread.phase = phase;
+}
+
+void counters_thread_start() {
+	if (!counters_enabled)
+		return;
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	for (int c = 0; c < COUNTER_COUNT; ++c) {
+		counter_thread.fds[c] = counters_available[c] ? counter_open(c) : -1;
+		counter_thread.pages[c] = NULL;
+		if (counter_thread.fds[c] < 0)
+			continue;
+		void *page = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, counter_thread.fds[c], 0);
+		if (page != MAP_FAILED)
+			counter_thread.pages[c] = page;
+	}
+	counter_thread.phase = -1;
+	memset(counter_thread_totals, 0, sizeof(counter_thread_totals));
+	counter_thread_rays = 0;
+	counters_phase(-1);
+}
+
+void counters_thread_stop() {
+	if (!counters_enabled)
+		return;
+
+	counters_phase(-1);
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	pthread_mutex_lock(&counter_mutex);
+	for (int p = 0; p < PHASE_COUNT; ++p)
+		for (int c = 0; c < COUNTER_COUNT; ++c)
+			counter_totals[p][c] += counter_thread_totals[p][c];
+	counter_rays += counter_thread_rays;
+	pthread_mutex_unlock(&counter_mutex);
+
+	for (int c = 0; c < COUNTER_COUNT; ++c) {
+		if (counter_thread.pages[c])
+			munmap(counter_thread.pages[c], pageSize);
+		if (counter_thread.fds[c] >= 0)
+			close(counter_thread.fds[c]);
+	}
+}
+
+// probe every counter once up front, so a machine without a pmu (or with
+// perf_event_paranoid locked down) renders normally instead of failing
+void counters_init() {
+	int any = 0;
+	for (int c = 0; c < COUNTER_COUNT; ++c) {
+		int fd = counter_open(c);
+		counters_available[c] = fd >= 0;
+		any |= fd >= 0;
+		if (fd >= 0)
+			close(fd);
+	}
+
+	if (!any) {
+		fprintf(stderr, "hardware counters unavailable (perf_event_open failed), rendering without them\n");
+		counters_enabled = 0;
+	}
+}
+
+void counters_report() {
+	if (!counters_enabled)
+		return;
+
+	const char *names[COUNTER_COUNT] = {"cycles", "instructions", "L1d misses", "LLC misses", "branch misses"};
+	double rays = counter_rays ? (double)counter_rays : 1.0;
+
+	fprintf(stderr, "%llu rays\n", (unsigned long long)counter_rays);
+	fprintf(stderr, "%-14s %16s %16s %8s %14s %14s %14s\n", "phase", names[0], names[1], "IPC",
+		"L1d miss/ray", "LLC miss/ray", "br miss/ray");
+	for (int p = 0; p < PHASE_COUNT; ++p) {
+		uint64_t *t = counter_totals[p];
+		char values[COUNTER_COUNT][32];
+		for (int c = 0; c < COUNTER_COUNT; ++c) {
+			if (!counters_available[c])
+				snprintf(values[c], sizeof(values[c]), "n/a");
+			else if (c <= COUNTER_INSTRUCTIONS)
+				snprintf(values[c], sizeof(values[c]), "%llu", (unsigned long long)t[c]);
+			else
+				snprintf(values[c], sizeof(values[c]), "%.4f", t[c] / rays);
+		}
+		char ipc[32] = "n/a";
+		if (counters_available[COUNTER_CYCLES] && counters_available[COUNTER_INSTRUCTIONS] && t[COUNTER_CYCLES])
+			snprintf(ipc, sizeof(ipc), "%.2f", (double)t[COUNTER_INSTRUCTIONS] / t[COUNTER_CYCLES]);
+		fprintf(stderr, "%-14s %16s %16s %8s %14s %14s %14s\n", phase_names[p],
+			values[COUNTER_CYCLES], values[COUNTER_INSTRUCTIONS], ipc,
+			values[COUNTER_L1D_MISSES], values[COUNTER_LLC_MISSES], values[COUNTER_BRANCH_MISSES]);
+	}
+}
+
+// bounding volume hierarchies, over the loose spheres, over the spheres of
+// each object and over the instances on top of those. nodes are stored
+// depth first with one item per leaf, so a subtree over n items is always
+// the 2n - 1 nodes starting at its root: the left child follows its parent
+// and the right child follows the whole left subtree. any subtree can be
+// rebuilt in place when the items under it move
+#define BVH_BINS 16
+// below this many items testing them all beats walking the tree
+#define BVH_MIN_SPHERES 8
+#define BVH_REBUILD_RATIO 1.3f
+#define BVH_PARALLEL_REFIT 4096
+
+float box_area(Box box) {
+	Vector3 d = vector3_subtract(box.max, box.min);
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+Box box_union(Box a, Box b) {
+	Box result;
+	result.min = (Vector3){fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z)};
+	result.max = (Vector3){fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z)};
+	return result;
+}
+
+Box box_empty() {
+	Box result = {vector3_all(INFINITY), vector3_all(-INFINITY)};
+	return result;
+}
+
+// a little larger than the sphere, so rounding never loses a grazing hit
+Box sphere_box(Sphere sphere) {
+	float r = sphere.radius * 1.0001f + 1e-6f;
+	Box result = {vector3_subtract(sphere.center, vector3_all(r)), vector3_add(sphere.center, vector3_all(r))};
+	return result;
+}
+
+// the box around all eight corners of a transformed box
+Box box_transform(Box box, const Transform *t) {
+	Box result = box_empty();
+	for (int corner = 0; corner < 8; ++corner) {
+		Vector3 p = {corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y, corner & 4 ? box.max.z : box.min.z};
+		p = transform_point(t, p);
+		result = box_union(result, (Box){p, p});
+	}
+	return result;
+}
+
+float vector3_axis(Vector3 v, int axis) {
+	return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+float box_center(Box box, int axis) {
+	return 0.5f * (vector3_axis(box.min, axis) + vector3_axis(box.max, axis));
+}
+
+float bvh_cost(Bvh *bvh, int node) {
+	float own = box_area(bvh->nodes[node].box);
+	return bvh->nodes[node].area / (own > 1e-12f ? own : 1e-12f);
+}
+
+int bvh_right(Bvh *bvh, int node) {
+	return node + 2 * bvh->nodes[node + 1].count;
+}
+
+// children have to be up to date
+void bvh_refit_node(Bvh *bvh, int node) {
+	BvhNode *n = &bvh->nodes[node];
+	if (n->count == 1) {
+		n->box = bvh->boxes[bvh->items[n->first]];
+		n->area = box_area(n->box);
+		n->worse = 0;
+		return;
+	}
+
+	BvhNode *left = &bvh->nodes[node + 1];
+	BvhNode *right = &bvh->nodes[bvh_right(bvh, node)];
+	n->box = box_union(left->box, right->box);
+	n->area = box_area(n->box) + left->area + right->area;
+	n->worse = left->worse || right->worse || bvh_cost(bvh, node) > BVH_REBUILD_RATIO * n->cost;
+}
+
+// every child comes after its parent, so walking backwards is bottom up
+void bvh_refit_subtree(Bvh *bvh, int node) {
+	for (int i = node + 2 * bvh->nodes[node].count - 2; i >= node; --i)
+		bvh_refit_node(bvh, i);
+}
+
+// binned sah build of the items[first .. first + count) into node and the
+// 2 * count - 2 nodes after it. returns the subtree's depth
+int bvh_build_node(Bvh *bvh, int node, int first, int count) {
+	BvhNode *n = &bvh->nodes[node];
+	n->first = first;
+	n->count = count;
+	if (count == 1) {
+		bvh_refit_node(bvh, node);
+		n->cost = bvh_cost(bvh, node);
+		return 1;
+	}
+
+	Box centers = box_empty();
+	for (int i = first; i < first + count; ++i) {
+		Box box = bvh->boxes[bvh->items[i]];
+		Vector3 c = vector3_scale(vector3_add(box.min, box.max), vector3_all(0.5f));
+		centers = box_union(centers, (Box){c, c});
+	}
+	Vector3 extent = vector3_subtract(centers.max, centers.min);
+	int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+	float start = vector3_axis(centers.min, axis);
+	float width = vector3_axis(extent, axis);
+
+	int leftCount = count / 2;
+	if (width > 0.0f && count > 2) {
+		int binCount[BVH_BINS] = {0};
+		Box binBox[BVH_BINS];
+		for (int b = 0; b < BVH_BINS; ++b)
+			binBox[b] = box_empty();
+		for (int i = first; i < first + count; ++i) {
+			Box box = bvh->boxes[bvh->items[i]];
+			int b = (int)((box_center(box, axis) - start) / width * BVH_BINS);
+			b = b < BVH_BINS ? b : BVH_BINS - 1;
+			binCount[b] += 1;
+			binBox[b] = box_union(binBox[b], box);
+		}
+
+		// sweep from the right once for the right hand areas, then from the
+		// left to find the cheapest split: area times item count per side
+		float rightArea[BVH_BINS];
+		Box side = box_empty();
+		for (int b = BVH_BINS - 1; b > 0; --b) {
+			side = box_union(side, binBox[b]);
+			rightArea[b] = box_area(side);
+		}
+		float best = INFINITY;
+		int bestBin = 1, bestCount = 0, below = 0;
+		side = box_empty();
+		for (int b = 1; b < BVH_BINS; ++b) {
+			side = box_union(side, binBox[b - 1]);
+			below += binCount[b - 1];
+			if (!below || below == count)
+				continue;
+			float cost = box_area(side) * below + rightArea[b] * (count - below);
+			if (cost < best) {
+				best = cost;
+				bestBin = b;
+				bestCount = below;
+			}
+		}
+
+		int i = first, j = first + count - 1;
+		while (i <= j) {
+			int b = (int)((box_center(bvh->boxes[bvh->items[i]], axis) - start) / width * BVH_BINS);
+			if ((b < BVH_BINS ? b : BVH_BINS - 1) < bestBin) {
+				++i;
+			} else {
+				int t = bvh->items[i];
+				bvh->items[i] = bvh->items[j];
+				bvh->items[j--] = t;
+			}
+		}
+		leftCount = bestCount;
+	}
+
+	int leftDepth = bvh_build_node(bvh, node + 1, first, leftCount);
+	int rightDepth = bvh_build_node(bvh, node + 2 * leftCount, first + leftCount, count - leftCount);
+	bvh_refit_node(bvh, node);
+	n->cost = bvh_cost(bvh, node);
+	n->worse = 0;
+	return 1 + (leftDepth > rightDepth ? leftDepth : rightDepth);
+}
+
+// full build over count items bounded by boxes, which the bvh keeps using
+void bvh_build(Bvh *bvh, Box *boxes, int count) {
+	bvh_free(bvh);
+	bvh->boxes = boxes;
+	bvh->count = count;
+	if (!count)
+		return;
+
+	bvh->nodes = malloc((2 * count - 1) * sizeof(BvhNode));
+	bvh->items = malloc(count * sizeof(int));
+	assert(bvh->nodes && bvh->items);
+	for (int i = 0; i < count; ++i)
+		bvh->items[i] = i;
+	bvh->depth = bvh_build_node(bvh, 0, 0, count);
+}
+
+// slab test against a box, only counting what is nearer than closest
+int box_hit(Line ray, Vector3 inverse, Box *box, float closest) {
+	float t0 = (box->min.x - ray.origin.x) * inverse.x, t1 = (box->max.x - ray.origin.x) * inverse.x;
+	float near = fminf(t0, t1), far = fmaxf(t0, t1);
+	t0 = (box->min.y - ray.origin.y) * inverse.y;
+	t1 = (box->max.y - ray.origin.y) * inverse.y;
+	near = fmaxf(near, fminf(t0, t1));
+	far = fminf(far, fmaxf(t0, t1));
+	t0 = (box->min.z - ray.origin.z) * inverse.z;
+	t1 = (box->max.z - ray.origin.z) * inverse.z;
+	near = fmaxf(near, fminf(t0, t1));
+	far = fminf(far, fmaxf(t0, t1));
+	return near <= far && far > 0.0f && near < closest;
+}
+
+// closest of the spheres a bvh was built over that is nearer than
+// hit->distance, hit->sphere is set to its index in spheres
+void bvh_intersect(Bvh *bvh, Sphere *spheres, Line ray, Hit *hit) {
+	if (bvh->count < BVH_MIN_SPHERES) {
+		for (int i = 0; i < bvh->count; ++i) {
+			float d  = line_sphere_intersect(ray, spheres[i], materials);
+			if (0.000001 < d && d < hit->distance) {
+				hit->distance = d;
+				hit->sphere = i;
+			}
+		}
+		return;
+	}
+
+	Vector3 inverse = {1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+	int stack[bvh->depth + 1];
+	int top = 0;
+	stack[top++] = 0;
+	while (top) {
+		int node = stack[--top];
+		BvhNode *n = &bvh->nodes[node];
+		if (!box_hit(ray, inverse, &n->box, hit->distance))
+			continue;
+		if (n->count > 1) {
+			stack[top++] = bvh_right(bvh, node);
+			stack[top++] = node + 1;
+			continue;
+		}
+
+		int i = bvh->items[n->first];
+		float d  = line_sphere_intersect(ray, spheres[i], materials);
+		// equal distances go to the lower index, whatever order the tree
+		// visits them in
+		if (0.000001 < d && (d < hit->distance || (d == hit->distance && i < hit->sphere))) {
+			hit->distance = d;
+			hit->sphere = i;
+		}
+	}
+}
+
+void instance_bounds() {
+	for (int i = 0; i < instance_count; ++i) {
+		Bvh *object = &object_bvhs[instances[i].object];
+		instance_boxes[i] = box_transform(object->nodes[0].box, &instances[i].toWorld);
+	}
+}
+
+void sphere_bounds() {
+	for (int i = 0; i < sphere_count; ++i)
+		sphere_boxes[i] = sphere_box(spheres[i]);
+}
+
+// once per loaded scene, scene_use then only points the globals at them
+void scene_bvh_build(Scene *scene) {
+	scene->sphereBoxes = malloc((scene->sphereCount + 1) * sizeof(Box));
+	scene->objectSphereBoxes = malloc((scene->objectSphereCount + 1) * sizeof(Box));
+	scene->instanceBoxes = malloc((scene->instanceCount + 1) * sizeof(Box));
+	scene->objectBvhs = calloc(scene->objectCount + 1, sizeof(Bvh));
+	assert(scene->sphereBoxes && scene->objectSphereBoxes && scene->instanceBoxes && scene->objectBvhs);
+
+	for (int i = 0; i < scene->sphereCount; ++i)
+		scene->sphereBoxes[i] = sphere_box(scene->spheres[i]);
+	bvh_build(&scene->sphereBvh, scene->sphereBoxes, scene->sphereCount);
+
+	for (int i = 0; i < scene->objectSphereCount; ++i)
+		scene->objectSphereBoxes[i] = sphere_box(scene->objectSpheres[i]);
+	for (int i = 0; i < scene->objectCount; ++i)
+		bvh_build(&scene->objectBvhs[i], scene->objectSphereBoxes + scene->objects[i].first, scene->objects[i].count);
+
+	for (int i = 0; i < scene->instanceCount; ++i) {
+		Instance *instance = &scene->instances[i];
+		scene->instanceBoxes[i] = box_transform(scene->objectBvhs[instance->object].nodes[0].box, &instance->toWorld);
+	}
+	bvh_build(&scene->instanceBvh, scene->instanceBoxes, scene->instanceCount);
+}
+
+// test one instance with the ray taken into object space. the direction is
+// renormalized there, so distances are converted on the way in and out
+void instance_intersect(int index, Line ray, Hit *hit) {
+	Instance *instance = &instances[index];
+	Object *object = &objects[instance->object];
+
+	Line local;
+	local.origin = transform_point(&instance->toObject, ray.origin);
+	local.direction = transform_vector(&instance->toObject, ray.direction);
+	float scale = vector3_length(local.direction);
+	local.direction = vector3_scale(local.direction, vector3_all(1.0f / scale));
+
+	Hit objectHit;
+	objectHit.sphere = -1;
+	objectHit.distance = hit->distance * scale;
+	bvh_intersect(&object_bvhs[instance->object], object_spheres + object->first, local, &objectHit);
+	if (objectHit.sphere >= 0 && objectHit.distance / scale < hit->distance) {
+		hit->distance = objectHit.distance / scale;
+		hit->sphere = object->first + objectHit.sphere;
+		hit->instance = index;
+	}
+}
+
+void instances_intersect(Line ray, Hit *hit) {
+	if (instance_count < BVH_MIN_SPHERES) {
+		for (int i = 0; i < instance_count; ++i)
+			instance_intersect(i, ray, hit);
+		return;
+	}
+
+	Vector3 inverse = {1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+	int stack[instance_bvh->depth + 1];
+	int top = 0;
+	stack[top++] = 0;
+	while (top) {
+		int node = stack[--top];
+		BvhNode *n = &instance_bvh->nodes[node];
+		if (!box_hit(ray, inverse, &n->box, hit->distance))
+			continue;
+		if (n->count > 1) {
+			stack[top++] = bvh_right(instance_bvh, node);
+			stack[top++] = node + 1;
+		} else {
+			instance_intersect(instance_bvh->items[n->first], ray, hit);
+		}
+	}
+}
+
+Hit scene_intersect(Line ray) {
+	counters_phase(PHASE_INTERSECT);
+	int stage = profile_enter(STAGE_INTERSECT);
+
+	Hit result;
+	result.distance = 100000.0;
+	result.sphere = -1;
+	result.instance = -1;
+	bvh_intersect(sphere_bvh, spheres, ray, &result);
+	if (instance_count)
+		instances_intersect(ray, &result);
+
+	if (result.sphere >= 0) {
+		result.point = vector3_add(ray.origin, vector3_scale(ray.direction, vector3_all(result.distance)));
+		if (result.instance < 0) {
+			result.normal = vector3_normalized(vector3_subtract(result.point, spheres[result.sphere].center));
+		} else {
+			Instance *instance = &instances[result.instance];
+			Vector3 local = transform_point(&instance->toObject, result.point);
+			Vector3 normal = vector3_subtract(local, object_spheres[result.sphere].center);
+			result.normal = vector3_normalized(transform_normal(&instance->toObject, normal));
+		}
+	}
+
+	profile_leave(stage);
+	return result;
+}
+
+// materials each path has hit, one bit per material index modulo 64.
+// with more materials than that a bit stands for several, which only
+// makes invalidation more conservative
+_Thread_local uint64_t path_touched;
+// the direct light from the loose emitters at the path's first surface is
+// already counted (--restir), so the path doesn't add it again
+_Thread_local int path_lit;
+
+uint64_t material_bit(int material) {
+	return 1ull << (material & 63);
+}
+
+// caustic photon map (--photons N). before rendering, N photons leave the
+// emissive spheres, and those that reach a surface without delta lobes
+// after at least one delta bounce, through glass or off it, are kept in a
+// hash grid of photon_radius cells. paths then pick up caustics from a
+// density estimate wherever they land rather than having to find the
+// light through the glass themselves, and drop what they would find
+// that way so nothing counts twice. instanced and sky light emit none
+#define PHOTON_CHUNK 4096
+
+typedef struct {
+	Vector3 position;
+	// back towards where the photon came from
+	Vector3 direction;
+	Vector3 power;
+	// materials on the photon's way, so lookdev edits drop what they change
+	uint64_t touched;
+} Photon;
+
+Photon *photons;
+int photon_count;
+// photons of bucket b are photons[photon_cells[b] .. photon_cells[b + 1])
+int *photon_cells;
+uint32_t photon_buckets;
+
+// emissive loose spheres and their share of the scene's light, for
+// everything that starts paths at the lights. picked by luminance times
+// area, emitter_cdf holds the running totals
+int *emitters;
+float *emitter_cdf;
+int emitter_count;
+// each loose sphere's index into emitters, -1 if it doesn't emit
+int *sphere_emitters;
+
+// the light tree: a bvh over the emitters' boxes, built like the scene's,
+// with the power of everything below each node. a point that needs a light
+// walks down it and takes each side with the odds of how much that side
+// could light it (estevez and kulla 2018), so picking one out of thousands
+// costs the tree's depth and mostly picks those that are close and bright
+typedef struct {
+	// the sphere around the node's box
+	Vector3 center;
+	float radius2;
+	float power;
+} LightNode;
+
+Bvh light_bvh;
+Box *light_boxes;
+// next to light_bvh's nodes, all traversal needs of them
+LightNode *light_nodes;
+
+void emitters_build() {
+	free(emitters);
+	free(emitter_cdf);
+	free(sphere_emitters);
+	free(light_boxes);
+	free(light_nodes);
+	emitter_count = 0;
+	emitters = malloc((sphere_count ? sphere_count : 1) * sizeof(int));
+	emitter_cdf = malloc((sphere_count ? sphere_count : 1) * sizeof(float));
+	sphere_emitters = malloc((sphere_count ? sphere_count : 1) * sizeof(int));
+	assert(emitters && emitter_cdf && sphere_emitters);
+	float total = 0.0f;
+	for (int i = 0; i < sphere_count; ++i) {
+		sphere_emitters[i] = -1;
+		Vector3 emission = materials[spheres[i].material].emission;
+		float luminance = 0.2126f * emission.x + 0.7152f * emission.y + 0.0722f * emission.z;
+		if (luminance <= 0.0f)
+			continue;
+		total += luminance * spheres[i].radius * spheres[i].radius;
+		sphere_emitters[i] = emitter_count;
+		emitters[emitter_count] = i;
+		emitter_cdf[emitter_count++] = total;
+	}
+	for (int i = 0; i < emitter_count; ++i)
+		emitter_cdf[i] /= total;
+
+	light_boxes = malloc((emitter_count ? emitter_count : 1) * sizeof(Box));
+	light_nodes = malloc((emitter_count ? 2 * emitter_count - 1 : 1) * sizeof(LightNode));
+	assert(light_boxes && light_nodes);
+	for (int e = 0; e < emitter_count; ++e)
+		light_boxes[e] = sphere_box(spheres[emitters[e]]);
+	bvh_build(&light_bvh, light_boxes, emitter_count);
+	// every child comes after its parent
+	for (int node = 2 * emitter_count - 2; node >= 0; --node) {
+		const BvhNode *n = &light_bvh.nodes[node];
+		LightNode *light = &light_nodes[node];
+		Vector3 half = vector3_scale(vector3_subtract(n->box.max, n->box.min), vector3_all(0.5f));
+		light->center = vector3_add(n->box.min, half);
+		light->radius2 = vector3_dot_product(half, half);
+		if (n->count == 1) {
+			int e = light_bvh.items[n->first];
+			light->power = (emitter_cdf[e] - (e ? emitter_cdf[e - 1] : 0.0f)) * total;
+		} else {
+			light->power = light_nodes[node + 1].power + light_nodes[bvh_right(&light_bvh, node)].power;
+		}
+	}
+}
+
+// the emitter u picks, and the probability it had
+int emitter_pick(float u, float *probability) {
+	int lo = 0, hi = emitter_count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (emitter_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*probability = emitter_cdf[lo] - (lo ? emitter_cdf[lo - 1] : 0.0f);
+	return emitters[lo];
+}
+
+// how much the lights under a node could at most bring to a point whose
+// surface faces normal: their power over the squared distance, times the
+// cosine at the point to the nearest direction inside the cone the node's
+// bounding sphere is seen under
+float light_importance(const LightNode *light, Vector3 point, Vector3 normal) {
+	Vector3 d = vector3_subtract(light->center, point);
+	float distance2 = vector3_dot_product(d, d);
+	// from inside the bounds any direction might reach a light
+	if (distance2 <= light->radius2)
+		return light->power / light->radius2;
+
+	float sinBound2 = light->radius2 / distance2;
+	float cosBound = sqrtf(1.0f - sinBound2);
+	float cosine = vector3_dot_product(normal, d) * fast_rsqrt(distance2);
+	if (cosine < cosBound) {
+		float sine = sqrtf(fmaxf(0.0f, 1.0f - cosine * cosine));
+		cosine = cosine * cosBound + sine * sqrtf(sinBound2);
+		if (cosine <= 0.0f)
+			return 0.0f;
+	} else {
+		cosine = 1.0f;
+	}
+	return light->power * cosine / distance2;
+}
+
+// an emitter for a point facing normal from the light tree, and the
+// probability it had. -1 when none can light it
+int light_pick(Vector3 point, Vector3 normal, float u, float *probability) {
+	*probability = 1.0f;
+	if (!emitter_count)
+		return -1;
+	int node = 0;
+	while (light_bvh.nodes[node].count > 1) {
+		int left = node + 1;
+		int right = bvh_right(&light_bvh, node);
+		float a = light_importance(&light_nodes[left], point, normal);
+		float b = light_importance(&light_nodes[right], point, normal);
+		if (a + b <= 0.0f)
+			return -1;
+		// u is used up a little on every level, stretch what is left of it
+		float p = a / (a + b);
+		if (u < p) {
+			node = left;
+			u = u / p;
+			*probability *= p;
+		} else {
+			node = right;
+			u = (u - p) / (1.0f - p);
+			*probability *= 1.0f - p;
+		}
+		u = fminf(u, 0x1.fffffep-1f);
+	}
+	return emitters[light_bvh.items[light_bvh.nodes[node].first]];
+}
+
+void photon_cell(Vector3 p, int cell[3]) {
+	cell[0] = (int)floorf(p.x / photon_radius);
+	cell[1] = (int)floorf(p.y / photon_radius);
+	cell[2] = (int)floorf(p.z / photon_radius);
+}
+
+uint32_t photon_bucket(const int cell[3]) {
+	return ((uint32_t)cell[0] * 73856093u ^ (uint32_t)cell[1] * 19349663u ^ (uint32_t)cell[2] * 83492791u)
+		& (photon_buckets - 1);
+}
+
+// caustic light reflected towards outgoing at a point, from the photons
+// within photon_radius that arrived on the normal's side
+Vector3 photon_gather(Vector3 point, Vector3 normal, Vector3 outgoing, const Material *material) {
+	Vector3 result = {0.0f, 0.0f, 0.0f};
+	int center[3];
+	photon_cell(point, center);
+	float radius2 = photon_radius * photon_radius;
+	for (int dz = -1; dz <= 1; ++dz) {
+		for (int dy = -1; dy <= 1; ++dy) {
+			for (int dx = -1; dx <= 1; ++dx) {
+				int cell[3] = {center[0] + dx, center[1] + dy, center[2] + dz};
+				uint32_t bucket = photon_bucket(cell);
+				for (int i = photon_cells[bucket]; i < photon_cells[bucket + 1]; ++i) {
+					Photon *photon = &photons[i];
+					Vector3 d = vector3_subtract(photon->position, point);
+					if (vector3_dot_product(d, d) > radius2 || vector3_dot_product(photon->direction, normal) <= 0.0f)
+						continue;
+					// other cells share the bucket
+					int own[3];
+					photon_cell(photon->position, own);
+					if (own[0] != cell[0] || own[1] != cell[1] || own[2] != cell[2])
+						continue;
+					Vector3 brdf = material_eval(material, photon->direction, outgoing, normal);
+					result = vector3_add(result, vector3_scale(brdf, photon->power));
+					path_touched |= photon->touched;
+				}
+			}
+		}
+	}
+	// flux over the disc, and the 2 pi the tracer leaves out of every
+	// hemisphere bounce so the two agree
+	return vector3_scale(result, vector3_all(1.0f / ((float)M_PI * radius2 * 2.0f * (float)M_PI)));
+}
+
+// path guiding (--guide). what paths find behind each bounce is learned
+// while rendering, in a hash grid of GUIDE_CELL cells (split by which way
+// the surface faces) that each hold a histogram of incident radiance over
+// GUIDE_RESOLUTION x GUIDE_RESOLUTION equal area bins of the sphere of
+// directions. bounces off surfaces without delta lobes then draw from
+// that histogram with probability GUIDE_FRACTION and from the brdf
+// otherwise, weighted by the density of the mix (one sample mis with the
+// balance heuristic). learning adds fixed point integers, so every
+// thread adds to one shared table without locks and the sum doesn't
+// depend on the order; after every pass guide_update turns it into the
+// cdfs the next pass samples. those are a cdf over the rows of bins
+// followed by one over the bins of each row, so a bounce only reads a
+// couple of cache lines of them
+#define GUIDE_CELL 0.5f
+#define GUIDE_BUCKETS 4096
+#define GUIDE_RESOLUTION 16
+#define GUIDE_BINS (GUIDE_RESOLUTION * GUIDE_RESOLUTION)
+#define GUIDE_STRIDE (GUIDE_RESOLUTION + GUIDE_BINS)
+#define GUIDE_FRACTION 0.5f
+// radiance per unit density is learned in units of 1 / GUIDE_FIXED, up
+// to GUIDE_CLAMP so one lucky path can't take over a cell
+#define GUIDE_FIXED 65536.0f
+#define GUIDE_CLAMP 1e6f
+
+int guiding = 0;
+atomic_ulong *guide_learned;
+// GUIDE_STRIDE floats per bucket, all 0 until something was learned
+float *guide_cdf;
+// cosine and sine of the angle around the y axis each column of bins
+// starts at
+float guide_edges[GUIDE_RESOLUTION][2];
+
+typedef struct {
+	int bin;
+	// radiance the path had collected before the bounce, and its
+	// throughput after it
+	Vector3 radiance;
+	Vector3 throughput;
+	float pdf;
+} GuideVertex;
+
+void guide_init() {
+	guide_learned = calloc(GUIDE_BUCKETS * GUIDE_BINS, sizeof(atomic_ulong));
+	guide_cdf = calloc(GUIDE_BUCKETS * GUIDE_STRIDE, sizeof(float));
+	assert(guide_learned && guide_cdf);
+	for (int column = 0; column < GUIDE_RESOLUTION; ++column) {
+		float phi = 2.0f * (float)M_PI * ((float)column / GUIDE_RESOLUTION - 0.5f);
+		guide_edges[column][0] = cosf(phi);
+		guide_edges[column][1] = sinf(phi);
+	}
+}
+
+// floorf is a libm call without sse4.1
+static inline int floor_int(float x) {
+	int i = (int)x;
+	return i - (x < (float)i);
+}
+
+int guide_bucket(Vector3 point, Vector3 normal) {
+	int axis = fabsf(normal.x) > fabsf(normal.y) ? fabsf(normal.x) > fabsf(normal.z) ? 0 : 2
+		: fabsf(normal.y) > fabsf(normal.z) ? 1 : 2;
+	int side = 2 * axis + (vector3_axis(normal, axis) < 0.0f);
+	uint32_t x = (uint32_t)floor_int(point.x * (1.0f / GUIDE_CELL));
+	uint32_t y = (uint32_t)floor_int(point.y * (1.0f / GUIDE_CELL));
+	uint32_t z = (uint32_t)floor_int(point.z * (1.0f / GUIDE_CELL));
+	return (x * 73856093u ^ y * 19349663u ^ z * 83492791u ^ (uint32_t)side * 2654435761u) & (GUIDE_BUCKETS - 1);
+}
+
+// bins split the height y evenly, and the angle around the y axis. rather
+// than atan2 the column is found from which side of the edges' directions
+// d is on: angles below 0 are the first half of the columns, and within a
+// half that side orders them
+int guide_bin(Vector3 d) {
+	int row = (int)((d.y + 1.0f) * 0.5f * GUIDE_RESOLUTION);
+	row = row < 0 ? 0 : row >= GUIDE_RESOLUTION ? GUIDE_RESOLUTION - 1 : row;
+	int column = d.z < 0.0f ? 0 : GUIDE_RESOLUTION / 2;
+	for (int count = GUIDE_RESOLUTION / 2; count > 1;) {
+		int half = count / 2;
+		const float *edge = guide_edges[column + half];
+		if (edge[0] * d.z - edge[1] * d.x >= 0.0f) {
+			column += half;
+			count -= half;
+		} else {
+			count = half;
+		}
+	}
+	return row * GUIDE_RESOLUTION + column;
+}
+
+// density over solid angle of a direction in bin of a bucket's histogram
+float guide_pdf(const float *cdf, int bin) {
+	int row = bin / GUIDE_RESOLUTION;
+	int column = bin % GUIDE_RESOLUTION;
+	const float *columns = &cdf[GUIDE_RESOLUTION + row * GUIDE_RESOLUTION];
+	float p = (cdf[row] - (row ? cdf[row - 1] : 0.0f)) * (columns[column] - (column ? columns[column - 1] : 0.0f));
+	return p * (float)(GUIDE_BINS * 0.25 * M_1_PI);
+}
+
+// the entry of a cdf of GUIDE_RESOLUTION entries that v falls in, and v
+// stretched back to [0, 1) within it
+int guide_pick(const float *cdf, float *v) {
+	int i = 0;
+	while (i < GUIDE_RESOLUTION - 1 && cdf[i] <= *v)
+		i += 1;
+	float low = i ? cdf[i - 1] : 0.0f;
+	*v = fminf((*v - low) / (cdf[i] - low), 0.99999994f);
+	return i;
+}
+
+// bounce off a surface without delta lobes, like material_sample but
+// drawing from the learned histogram part of the time. the brdf comes
+// back divided by 2 pi times the mixture's density, so it is what
+// material_sample would give for the same direction, and where nothing
+// was learned yet material_sample does the bounce
+Vector3 guide_sample(const Material *material, Vector3 point, Vector3 outgoing, Vector3 normal, Vector3 *incoming,
+	float *cosine, GuideVertex *vertex)
+{
+	int bucket = guide_bucket(point, normal);
+	const float *cdf = &guide_cdf[bucket * GUIDE_STRIDE];
+	float uniform = 0.5f * (float)M_1_PI;
+	if (cdf[GUIDE_RESOLUTION - 1] == 0.0f) {
+		int delta;
+		Vector3 brdf = material_sample(material, outgoing, normal, incoming, cosine, &delta);
+		vertex->bin = bucket * GUIDE_BINS + guide_bin(*incoming);
+		vertex->pdf = *cosine > 0.0f ? uniform : 0.0f;
+		return brdf;
+	}
+
+	profile_stage = STAGE_SAMPLING;
+	float fraction = GUIDE_FRACTION;
+	float u[3];
+	sampler_next(u, 3);
+	if (u[0] < fraction) {
+		// the same number picks the row and then the bin in it
+		float v = u[0] / fraction;
+		int row = guide_pick(cdf, &v);
+		int column = guide_pick(&cdf[GUIDE_RESOLUTION + row * GUIDE_RESOLUTION], &v);
+		float y = -1.0f + 2.0f * (row + u[1]) / GUIDE_RESOLUTION;
+		float phi = 2.0f * (float)M_PI * ((column + u[2]) / GUIDE_RESOLUTION - 0.5f);
+		float r = sqrtf(fmaxf(0.0f, 1.0f - y * y));
+		*incoming = (Vector3){r * cosf(phi), y, r * sinf(phi)};
+	} else {
+		*incoming = vector3_around(normal, u[1], 2.0f * (float)M_PI * u[2]);
+	}
+
+	profile_stage = STAGE_BRDF;
+	*cosine = vector3_dot_product(*incoming, normal);
+	int bin = guide_bin(*incoming);
+	vertex->bin = bucket * GUIDE_BINS + bin;
+	if (*cosine <= 0.0f) {
+		vertex->pdf = 0.0f;
+		return black;
+	}
+	vertex->pdf = fraction * guide_pdf(cdf, bin) + (1.0f - fraction) * uniform;
+	return vector3_scale(material_eval(material, *incoming, outgoing, normal), vector3_all(uniform / vertex->pdf));
+}
+
+// once a path is done, what arrived at each guided bounce is what the
+// path collected after it, divided by the throughput it came with
+void guide_learn(const GuideVertex *vertices, int count, Vector3 total) {
+	for (int i = 0; i < count; ++i) {
+		const GuideVertex *v = &vertices[i];
+		if (v->pdf <= 0.0f)
+			continue;
+		Vector3 after = vector3_subtract(total, v->radiance);
+		Vector3 t = v->throughput;
+		float r = t.x > 0.0f ? after.x / t.x : 0.0f;
+		float g = t.y > 0.0f ? after.y / t.y : 0.0f;
+		float b = t.z > 0.0f ? after.z / t.z : 0.0f;
+		float value = (0.2126f * r + 0.7152f * g + 0.0722f * b) / v->pdf;
+		if (value > 0.0f)
+			atomic_fetch_add_explicit(&guide_learned[v->bin], (unsigned long)(fminf(value, GUIDE_CLAMP) * GUIDE_FIXED),
+				memory_order_relaxed);
+	}
+}
+
+// world space radiance cache (--radiance-cache fast|unbiased). what leaves
+// rough surfaces changes slowly over space, so every path adds what it
+// found after each rough vertex to a hash grid, and a path that reaches a
+// rough surface right after a rough bounce can take the light leaving it
+// from there instead of tracing on. cells are about RADIANCE_CELL_PIXELS
+// pixels wide at their distance from the camera (rounded to a power of
+// two), split by which way the surface faces and by the bounce, since
+// what is left of a path depends on how many bounces it has left. slots
+// are claimed with a compare and swap on their key and learning adds
+// fixed point integers, so no thread ever waits; after every pass
+// radiance_update turns the sums into the means the next pass reads.
+// the fast mode ends the path at the cache, blurring it a little. the
+// unbiased one uses the cache as a control variate: it stops with
+// probability RADIANCE_STOP and scores the cached value, and otherwise
+// traces on and scores (traced - RADIANCE_STOP * cached) / (1 -
+// RADIANCE_STOP), whose expectation is exact however good the cache is
+#define RADIANCE_SLOTS (1 << 19)
+#define RADIANCE_PROBES 16
+#define RADIANCE_CELL_PIXELS 8.0f
+#define RADIANCE_ROUGHNESS 0.8f
+#define RADIANCE_MIN_SAMPLES 16
+#define RADIANCE_STOP 0.75f
+// learned in units of 1 / RADIANCE_FIXED, up to RADIANCE_CLAMP so one
+// lucky path can't take over a cell
+#define RADIANCE_FIXED 65536.0f
+#define RADIANCE_CLAMP 1e4f
+
+enum { RADIANCE_OFF, RADIANCE_FAST, RADIANCE_UNBIASED };
+int radiance_mode = RADIANCE_OFF;
+// 0 for a free slot
+atomic_ulong *radiance_keys;
+// red, green, blue and the number of paths, per slot
+atomic_ulong *radiance_learned;
+// the means as of the last update, and 1 where there were enough paths
+float *radiance_cached;
+// a cell's width per unit of distance from the camera
+float radiance_footprint;
+
+typedef struct {
+	uint64_t key;
+	// radiance the path had collected before it got here, and the
+	// throughput it arrived with
+	Vector3 radiance;
+	Vector3 throughput;
+} RadianceVertex;
+
+// pixelSize is a pixel's width one unit in front of the camera
+void radiance_init(float pixelSize) {
+	radiance_footprint = RADIANCE_CELL_PIXELS * pixelSize;
+	radiance_keys = calloc(RADIANCE_SLOTS, sizeof(atomic_ulong));
+	radiance_learned = calloc(4 * RADIANCE_SLOTS, sizeof(atomic_ulong));
+	radiance_cached = calloc(4 * RADIANCE_SLOTS, sizeof(float));
+	assert(radiance_keys && radiance_learned && radiance_cached);
+}
+
+// surfaces whose outgoing light barely depends on the direction, so one
+// value per cell serves every path that arrives
+int radiance_rough(const Material *material) {
+	return material->kind == MATERIAL_DIFFUSE
+		|| (material->kind != MATERIAL_DIELECTRIC && material->roughness >= RADIANCE_ROUGHNESS);
+}
+
+// cell size exponent (6 bits), side (3), bounce (6) and cell coordinates
+// (16 bits each), with the lowest bit set so no key is 0
+_Static_assert(BOUNCE_COUNT <= 64, "radiance_key has 6 bits for the bounce");
+
+uint64_t radiance_key(Vector3 point, Vector3 normal, int bounce) {
+	float distance = vector3_length(vector3_subtract(point, camera.origin));
+	int level;
+	frexpf(fminf(fmaxf(distance * radiance_footprint, 1e-6f), 1e9f), &level);
+	float inverse = ldexpf(1.0f, -level);
+	int axis = fabsf(normal.x) > fabsf(normal.y) ? fabsf(normal.x) > fabsf(normal.z) ? 0 : 2
+		: fabsf(normal.y) > fabsf(normal.z) ? 1 : 2;
+	int side = 2 * axis + (vector3_axis(normal, axis) < 0.0f);
+	uint64_t x = (uint64_t)floor_int(point.x * inverse) & 0xffff;
+	uint64_t y = (uint64_t)floor_int(point.y * inverse) & 0xffff;
+	uint64_t z = (uint64_t)floor_int(point.z * inverse) & 0xffff;
+	return (uint64_t)(level + 32) << 58 | (uint64_t)side << 55 | (uint64_t)bounce << 49 | x << 33 | y << 17 | z << 1 | 1;
+}
+
+uint32_t radiance_hash(uint64_t key) {
+	return hash_mix((uint32_t)key, (uint32_t)(key >> 32)) & (RADIANCE_SLOTS - 1);
+}
+
+// the slot holding key, -1 if it has none
+int radiance_find(uint64_t key) {
+	uint32_t slot = radiance_hash(key);
+	for (int i = 0; i < RADIANCE_PROBES; ++i, slot = (slot + 1) & (RADIANCE_SLOTS - 1)) {
+		uint64_t found = atomic_load_explicit(&radiance_keys[slot], memory_order_relaxed);
+		if (found == key)
+			return (int)slot;
+		if (!found)
+			return -1;
+	}
+	return -1;
+}
+
+// the slot holding key, claiming one for it if needed. -1 once the probes
+// only find other keys
+int radiance_claim(uint64_t key) {
+	uint32_t slot = radiance_hash(key);
+	for (int i = 0; i < RADIANCE_PROBES; ++i, slot = (slot + 1) & (RADIANCE_SLOTS - 1)) {
+		unsigned long found = atomic_load_explicit(&radiance_keys[slot], memory_order_relaxed);
+		if (!found && atomic_compare_exchange_strong_explicit(&radiance_keys[slot], &found, key,
+			memory_order_relaxed, memory_order_relaxed))
+			return (int)slot;
+		if (found == key)
+			return (int)slot;
+	}
+	return -1;
+}
+
+// once a path is done, what left each rough vertex is what the path
+// collected after arriving there, divided by the throughput it arrived with
+void radiance_learn(const RadianceVertex *vertices, int count, Vector3 total) {
+	for (int i = 0; i < count; ++i) {
+		const RadianceVertex *v = &vertices[i];
+		Vector3 after = vector3_subtract(total, v->radiance);
+		Vector3 t = v->throughput;
+		if (t.x <= 0.0f && t.y <= 0.0f && t.z <= 0.0f)
+			continue;
+		int slot = radiance_claim(v->key);
+		if (slot < 0)
+			continue;
+		float value[3] = {t.x > 0.0f ? after.x / t.x : 0.0f, t.y > 0.0f ? after.y / t.y : 0.0f,
+			t.z > 0.0f ? after.z / t.z : 0.0f};
+		atomic_ulong *learned = &radiance_learned[4 * slot];
+		for (int c = 0; c < 3; ++c)
+			atomic_fetch_add_explicit(&learned[c],
+				(unsigned long)(fminf(fmaxf(value[c], 0.0f), RADIANCE_CLAMP) * RADIANCE_FIXED), memory_order_relaxed);
+		atomic_fetch_add_explicit(&learned[3], 1, memory_order_relaxed);
+	}
+}
+
+// trace a path whose first intersection is already known. camera rays
+// don't change between samples, so the caller finds their hit once per
+// pixel and only the random bounces are redone for every sample
+Vector3 ray_trace_from(Line ray, Hit hit) {
+	int stage = profile_enter(STAGE_TRACE);
+	Vector3 color = {1.0, 1.0, 1.0};
+	// light picked up from emitters along the way
+	Vector3 radiance = {0.0, 0.0, 0.0};
+	// incident
+	Vector3 incomingRay;
+	// reflected
+	Vector3 outgoingRay;
+	// with a photon map: the last surface without delta lobes took the
+	// caustics from it, and how many delta bounces came since
+	int gathered = 0;
+	int deltas = 0;
+	// with path guiding: the guided bounces, learned from at the end
+	GuideVertex guided[BOUNCE_COUNT];
+	int guidedCount = 0;
+	// with a radiance cache: the rough vertices, and whether the last
+	// bounce was off one
+	RadianceVertex cached[BOUNCE_COUNT];
+	int cachedCount = 0;
+	int roughBefore = 0;
+
+	for (int bounce = 0; bounce < BOUNCE_COUNT; ++bounce) {
+		if (bounce > 0)
+			hit = scene_intersect(ray);
+
+		if (hit.sphere < 0) {
+			color = vector3_scale(color, skyblue);
+			break;
+		}
+
+		counters_phase(PHASE_SHADE);
+
+		float cosTheta;
+		Vector3 brdf;
+		int delta;
+
+		int index = hit_sphere(hit)->material;
+		const Material *material = &materials[index];
+		path_touched |= material_bit(index);
+		// light found through delta bounces after a gather is a caustic the
+		// photons already brought
+		if (material_emits(material) && !(gathered && deltas) && !(bounce == 1 && path_lit && hit.instance < 0))
+			radiance = vector3_add(radiance, vector3_scale(color, material->emission));
+
+		// emitters are left out, the first bounce's light may have been
+		// counted apart (--restir)
+		int rough = radiance_mode && radiance_rough(material);
+		if (rough && bounce > 0 && !material_emits(material)) {
+			uint64_t key = radiance_key(hit.point, hit.normal, bounce);
+			// taken whether the cell is there or not, so the dimensions of
+			// later bounces don't depend on what the cache holds
+			float u = 0.0f;
+			if (roughBefore && radiance_mode == RADIANCE_UNBIASED)
+				sampler_next(&u, 1);
+			int slot = roughBefore ? radiance_find(key) : -1;
+			if (slot >= 0 && radiance_cached[4 * slot + 3] > 0.0f) {
+				Vector3 value = {radiance_cached[4 * slot], radiance_cached[4 * slot + 1], radiance_cached[4 * slot + 2]};
+				// not learned from, the cell would only learn its own mean
+				if (u < RADIANCE_STOP) {
+					radiance = vector3_add(radiance, vector3_scale(color, value));
+					color = black;
+					break;
+				}
+				radiance = vector3_subtract(radiance,
+					vector3_scale(color, vector3_scale(value, vector3_all(RADIANCE_STOP / (1.0f - RADIANCE_STOP)))));
+				color = vector3_scale(color, vector3_all(1.0f / (1.0f - RADIANCE_STOP)));
+			}
+			// recorded after the control variate, so the cell learns what
+			// was traced from here rather than the corrected estimate
+			RadianceVertex *vertex = &cached[cachedCount++];
+			vertex->key = key;
+			vertex->radiance = radiance;
+			vertex->throughput = color;
+		}
+		roughBefore = rough;
+
+		outgoingRay = vector3_scale(ray.direction, vector3_all(-1.0));
+		int gathers = photon_count && material->kind != MATERIAL_DIELECTRIC;
+		if (gathers) {
+			Vector3 caustic = photon_gather(hit.point, hit.normal, outgoingRay, material);
+			radiance = vector3_add(radiance, vector3_scale(color, caustic));
+		}
+
+		GuideVertex *guide = NULL;
+		if (guiding && material->kind != MATERIAL_DIELECTRIC) {
+			guide = &guided[guidedCount++];
+			guide->radiance = radiance;
+			brdf = guide_sample(material, hit.point, outgoingRay, hit.normal, &incomingRay, &cosTheta, guide);
+			delta = 0;
+		} else {
+			brdf = material_sample(material, outgoingRay, hit.normal, &incomingRay, &cosTheta, &delta);
+		}
+		profile_stage = STAGE_TRACE;
+		if (delta) {
+			deltas += 1;
+		} else {
+			gathered = gathers;
+			deltas = 0;
+		}
+
+		ray.origin = hit.point;
+		// refracted rays leave from the surface they just crossed, nudge
+		// them off it so the next intersection doesn't find it again
+		if (material->kind == MATERIAL_DIELECTRIC)
+			ray.origin = vector3_add(ray.origin, vector3_scale(incomingRay, vector3_all(1e-4)));
+		ray.direction = incomingRay;
+
+		// brdf * light * cosTheta;
+		color  = vector3_scale(vector3_scale(color, brdf), vector3_all(cosTheta));
+		// color  = brdf;
+		if (guide)
+			guide->throughput = color;
+	}
+
+	Vector3 result = vector3_add(radiance, color);
+	if (guidedCount)
+		guide_learn(guided, guidedCount, result);
+	if (cachedCount)
+		radiance_learn(cached, cachedCount, result);
+	profile_leave(stage);
+	return result;
+}
+
+Vector3 ray_trace(Line ray) {
+	return ray_trace_from(ray, scene_intersect(ray));
+}
+
+// chrome trace-event timeline (--trace), one event list per thread so
+// recording never needs a lock; open the json in ui.perfetto.dev
+typedef struct {
+	const char *name;
+	uint64_t begin;
+	uint64_t end;
+	int tile;
+} TraceEvent;
+
+typedef struct {
+	TraceEvent *events;
+	int count;
+	int capacity;
+} TraceBuffer;
+
+int trace_enabled = 0;
+uint64_t trace_epoch;
+// main thread, render workers, then the sequence encoder
+#define ENCODER_THREAD (MAX_THREADS + 1)
+TraceBuffer trace_buffers[MAX_THREADS + 2];
+_Thread_local int thread_index = 0;
+
+uint64_t time_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t trace_begin() {
+	return trace_enabled ? time_now() : 0;
+}
+
+void trace_end(const char *name, uint64_t begin, int tile) {
+	if (!trace_enabled)
+		return;
+
+	TraceBuffer *buffer = &trace_buffers[thread_index];
+	if (buffer->count == buffer->capacity) {
+		buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+		buffer->events = realloc(buffer->events, buffer->capacity * sizeof(TraceEvent));
+		assert(buffer->events);
+	}
+
+	TraceEvent *event = &buffer->events[buffer->count++];
+	event->name = name;
+	event->begin = begin;
+	event->end = time_now();
+	event->tile = tile;
+}
+
+int trace_write(const char *path, int threadCount) {
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return 0;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"raytrace\"}}");
+	for (int t = 0; t <= ENCODER_THREAD; ++t) {
+		if (t > threadCount && t < ENCODER_THREAD)
+			continue;
+		if (t == ENCODER_THREAD && !trace_buffers[t].count)
+			break;
+
+		if (t == 0)
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+		else if (t == ENCODER_THREAD)
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"encoder\"}}", t);
+		else
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", t, t);
+
+		TraceBuffer *buffer = &trace_buffers[t];
+		for (int i = 0; i < buffer->count; ++i) {
+			TraceEvent *event = &buffer->events[i];
+			// timestamps are in microseconds
+			fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				event->name, event->tile < 0 ? "phase" : "tile", t,
+				(event->begin - trace_epoch) / 1000.0, (event->end - event->begin) / 1000.0);
+			if (event->tile >= 0)
+				fprintf(file, ",\"args\":{\"tile\":%d}", event->tile);
+			fprintf(file, "}");
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	return fclose(file) == 0;
+}
+
+// film holds the running sum of every sample, tone mapping divides by the
+// per-pixel count so a snapshot can be taken after any pass
+int image_width = IMAGE_WIDTH;
+int image_height = IMAGE_HEIGHT;
+int pixel_count;
+int tiles_x;
+int tile_count;
+
+Vector3 *film;
+int *film_samples;
+// welford running mean and squared deviation of each pixel's luminance
+double *film_mean;
+double *film_m2;
+// materials any of a pixel's paths touched, and what its camera ray hits
+uint64_t *film_touched;
+int *film_primary;
+float *film_depth;
+// light tracing's share of each pixel (bidirectional integrator) and all
+// of a metropolis render, in fixed point so any thread can add to it and
+// the sums don't depend on the order they do
+#define SPLAT_FIXED 16777216.0
+atomic_ulong *film_splat;
+// what a splat is worth in a metropolis render
+double mlt_scale;
+Color8 *image;
+
+// only pixels inside [x0, x1) x [y0, y1) are rendered
+int region_x0, region_y0, region_x1, region_y1;
+
+// samples each pixel still has to get in the current pass
+int *pass_plan;
+uint64_t pass_deadline;
+
+// (re)allocate a cleared film for a width x height frame
+void film_allocate(int width, int height) {
+	free(film);
+	free(film_samples);
+	free(film_mean);
+	free(film_m2);
+	free(film_touched);
+	free(film_primary);
+	free(film_depth);
+	free(film_splat);
+	free(image);
+	free(pass_plan);
+
+	image_width = width;
+	image_height = height;
+	pixel_count = width * height;
+	tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tile_count = tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+
+	film = calloc(pixel_count, sizeof(Vector3));
+	film_samples = calloc(pixel_count, sizeof(int));
+	film_mean = calloc(pixel_count, sizeof(double));
+	film_m2 = calloc(pixel_count, sizeof(double));
+	film_touched = calloc(pixel_count, sizeof(uint64_t));
+	film_primary = calloc(pixel_count, sizeof(int));
+	film_depth = calloc(pixel_count, sizeof(float));
+	film_splat = calloc(3 * pixel_count, sizeof(atomic_ulong));
+	image = calloc(pixel_count, sizeof(Color8));
+	pass_plan = calloc(pixel_count, sizeof(int));
+	assert(film && film_samples && film_mean && film_m2 && film_touched && film_primary && film_depth);
+	assert(film_splat && image && pass_plan);
+
+	region_x0 = 0;
+	region_y0 = 0;
+	region_x1 = width;
+	region_y1 = height;
+}
+
+int in_region(int index) {
+	int x = index % image_width;
+	int y = index / image_width;
+	return region_x0 <= x && x < region_x1 && region_y0 <= y && y < region_y1;
+}
+// set by SIGTERM/SIGINT, e.g. a preemptible node being reclaimed
+volatile sig_atomic_t stop_requested = 0;
+
+void stop_signal(int signal) {
+	(void)signal;
+	stop_requested = 1;
+}
+
+// where the progressive loop is, everything else lives in the film
+typedef struct {
+	int pass;
+	int samples;
+	long spent;
+	// the pass in flight, if a checkpoint landed in the middle of one
+	int passActive;
+	int goal;
+	long planned;
+} Progress;
+
+void tile_bounds(int tile, int *x0, int *y0, int *x1, int *y1) {
+	*x0 = (tile % tiles_x) * TILE_SIZE;
+	*y0 = (tile / tiles_x) * TILE_SIZE;
+	*x1 = *x0 + TILE_SIZE < image_width ? *x0 + TILE_SIZE : image_width;
+	*y1 = *y0 + TILE_SIZE < image_height ? *y0 + TILE_SIZE : image_height;
+}
+
+Line camera_ray(int x, int y) {
+	Line ray;
+	float u = (float)(x - (image_width / 2)) / image_height * (2.0f * camera.scale);
+	float v = (float)((image_height / 2) - y) / image_height * (2.0f * camera.scale);
+	ray.origin = camera.origin;
+	ray.direction = vector3_add(
+		vector3_add(vector3_scale(camera.right, vector3_all(u)), vector3_scale(camera.up, vector3_all(v))),
+		camera.forward);
+	ray.direction = vector3_normalized(ray.direction);
+	return ray;
+}
+
+// a ray through any point of the film, x and y in pixels from the top left
+// corner of the frame, so pixel x, y covers [x, x + 1) x [y, y + 1)
+Line camera_ray_at(float x, float y) {
+	float size = 2.0f * camera.scale / image_height;
+	Line ray;
+	ray.origin = camera.origin;
+	ray.direction = vector3_normalized(vector3_add(vector3_add(
+		vector3_scale(camera.right, vector3_all((x - 0.5f - image_width / 2) * size)),
+		vector3_scale(camera.up, vector3_all((image_height / 2 + 0.5f - y) * size))),
+		camera.forward));
+	return ray;
+}
+
+// where direction d from the camera origin lands on the film, -1 if it's
+// behind the camera or outside the frame
+int camera_pixel(Camera view, Vector3 d) {
+	float forward = vector3_dot_product(d, view.forward);
+	if (forward <= 0.0)
+		return -1;
+
+	float u = vector3_dot_product(d, view.right) / forward;
+	float v = vector3_dot_product(d, view.up) / forward;
+	int x = (int)floorf(u / (2.0f * view.scale) * image_height + 0.5f) + image_width / 2;
+	int y = image_height / 2 - (int)floorf(v / (2.0f * view.scale) * image_height + 0.5f);
+	if (x < 0 || x >= image_width || y < 0 || y >= image_height)
+		return -1;
+	return y * image_width + x;
+}
+
+// bidirectional path tracing (--integrator bdpt). every camera sample also
+// walks a path out from a light, and each vertex of one subpath is joined
+// to each vertex of the other. all the ways of building the same path are
+// weighed against each other with the power heuristic, so caustics come
+// from the light side and what the camera finds easily from its own.
+// joins that go through the camera vertex itself land on whatever pixel
+// they land on and are added to film_splat
+enum { INTEGRATOR_PATH, INTEGRATOR_BDPT, INTEGRATOR_MLT };
+int integrator = INTEGRATOR_PATH;
+
+typedef struct {
+	Vector3 point;
+	Vector3 normal;
+	// towards the vertex before this one on its own subpath
+	Vector3 back;
+	// throughput of the subpath up to here
+	Vector3 beta;
+	// NULL for the camera
+	const Material *material;
+	// loose sphere it lies on, -1 for instanced ones and the camera
+	int sphere;
+	// densities over area of sampling this vertex from the one before it,
+	// and going the other way from the one after it
+	float pdfForward;
+	float pdfReverse;
+	// the bounce out of it took a delta lobe
+	int delta;
+} PathVertex;
+
+// how likely the diffuse part of a dielectric is picked for light leaving
+// towards outgoing, 0 under total internal reflection
+float dielectric_diffuse(const Material *material, Vector3 outgoing, Vector3 normal) {
+	float cosOut = vector3_dot_product(normal, outgoing);
+	float eta = 1.0f / material->ior;
+	if (cosOut < 0.0f) {
+		cosOut = -cosOut;
+		eta = material->ior;
+	}
+	float k;
+	float fresnel = dielectric_fresnel(material, cosOut, eta, &k);
+	return k < 0.0f ? 0.0f : (1.0f - fresnel) * (1.0f - material->transmission);
+}
+
+// density over solid angle of bouncing off v towards to when the light
+// came along from, for the lobes without deltas
+float vertex_pdf(const PathVertex *v, Vector3 from, Vector3 to) {
+	float side = vector3_dot_product(to, v->normal);
+	if (v->material->kind != MATERIAL_DIELECTRIC)
+		return side > 0.0f ? 0.5f * (float)M_1_PI : 0.0f;
+	if (side * vector3_dot_product(from, v->normal) <= 0.0f)
+		return 0.0f;
+	return dielectric_diffuse(v->material, from, v->normal) * 0.5f * (float)M_1_PI;
+}
+
+// the brdf at v the way the path tracer integrates it: the hemisphere
+// lobes are sampled without their 1 / pdf, so their brdf is 1 / (2 pi) of
+// what material_eval gives
+Vector3 vertex_brdf(const PathVertex *v, Vector3 toCamera, Vector3 toLight) {
+	float cosCamera = vector3_dot_product(toCamera, v->normal);
+	float cosLight = vector3_dot_product(toLight, v->normal);
+	if (v->material->kind != MATERIAL_DIELECTRIC) {
+		if (cosCamera <= 0.0f || cosLight <= 0.0f)
+			return black;
+		return vector3_scale(material_eval(v->material, toLight, toCamera, v->normal), vector3_all(0.5f * (float)M_1_PI));
+	}
+	if (cosCamera * cosLight <= 0.0f)
+		return black;
+	float diffuse = dielectric_diffuse(v->material, toCamera, v->normal);
+	return vector3_scale(v->material->color, vector3_all(diffuse * 0.5f * (float)(M_1_PI * M_1_PI)));
+}
+
+// radiance the point on a light sends towards direction
+Vector3 vertex_emitted(const PathVertex *v, Vector3 direction) {
+	return vector3_dot_product(v->normal, direction) > 0.0f ? v->material->emission : black;
+}
+
+// density over area at to of sampling it from from over solid angle
+float pdf_area(float pdf, const PathVertex *from, const PathVertex *to) {
+	Vector3 d = vector3_subtract(to->point, from->point);
+	float distance2 = vector3_dot_product(d, d);
+	if (to->material)
+		pdf *= fabsf(vector3_dot_product(to->normal, d)) / sqrtf(distance2);
+	return pdf / distance2;
+}
+
+// density over area of a light picking the point v is at, 0 if no light
+// can start a subpath there
+float emitter_pdf(const PathVertex *v) {
+	int e = v->sphere >= 0 ? sphere_emitters[v->sphere] : -1;
+	if (e < 0)
+		return 0.0f;
+	float radius = spheres[v->sphere].radius;
+	return (emitter_cdf[e] - (e ? emitter_cdf[e - 1] : 0.0f)) / (4.0f * (float)M_PI * radius * radius);
+}
+
+// area of the film on the image plane one unit in front of the camera.
+// light subpaths compete with the camera samples of every pixel, so the
+// camera's density and importance are spread over all of it
+float film_area() {
+	float size = 2.0f * camera.scale / image_height;
+	return size * size * pixel_count;
+}
+
+// the pinhole's importance and density over solid angle towards d, 0
+// outside the frame
+float camera_importance(Vector3 d, float *pdf, int *pixel) {
+	*pixel = camera_pixel(camera, d);
+	if (*pixel < 0)
+		return 0.0f;
+	float cosine = vector3_dot_product(d, camera.forward);
+	*pdf = 1.0f / (film_area() * cosine * cosine * cosine);
+	return *pdf / cosine;
+}
+
+// only what lies between the two points matters, so the trees skip
+// everything beyond them
+int bdpt_visible(Vector3 a, Vector3 b) {
+	counters_phase(PHASE_INTERSECT);
+	int stage = profile_enter(STAGE_INTERSECT);
+	Vector3 d = vector3_subtract(b, a);
+	float distance = sqrtf(vector3_dot_product(d, d));
+	Line ray;
+	ray.direction = vector3_scale(d, vector3_all(1.0f / distance));
+	ray.origin = vector3_add(a, vector3_scale(ray.direction, vector3_all(1e-4)));
+	Hit hit;
+	hit.distance = distance - 2e-4f;
+	hit.sphere = -1;
+	hit.instance = -1;
+	bvh_intersect(sphere_bvh, spheres, ray, &hit);
+	if (instance_count)
+		instances_intersect(ray, &hit);
+	profile_leave(stage);
+	return hit.sphere < 0;
+}
+
+// extend a subpath from path[count - 1] along ray, sampled with density pdf
+// over solid angle, until it has max vertices or escapes. the camera's
+// subpath also bounces off its last vertex and hands back what the path
+// tracer would add for leaving: the sky, or what is left at the bounce limit
+int bdpt_walk(PathVertex *path, int count, int max, Line ray, float pdf, Vector3 beta, int camera, Vector3 *escaped) {
+	while (count < max) {
+		Hit hit = scene_intersect(ray);
+		if (hit.sphere < 0) {
+			if (camera)
+				*escaped = vector3_scale(beta, skyblue);
+			return count;
+		}
+
+		counters_phase(PHASE_SHADE);
+		PathVertex *v = &path[count];
+		PathVertex *previous = &path[count - 1];
+		int index = hit_sphere(hit)->material;
+		path_touched |= material_bit(index);
+		v->point = hit.point;
+		v->normal = hit.normal;
+		v->back = vector3_scale(ray.direction, vector3_all(-1.0f));
+		v->beta = beta;
+		v->material = &materials[index];
+		v->sphere = hit.instance < 0 ? hit.sphere : -1;
+		v->pdfForward = pdf_area(pdf, previous, v);
+		v->pdfReverse = 0.0f;
+		v->delta = 0;
+		count += 1;
+		if (count == max && !camera)
+			break;
+
+		Vector3 incoming;
+		float cosine;
+		int delta;
+		Vector3 weight = material_sample(v->material, v->back, v->normal, &incoming, &cosine, &delta);
+		profile_stage = STAGE_TRACE;
+		if (delta) {
+			v->delta = 1;
+			pdf = 0.0f;
+			previous->pdfReverse = 0.0f;
+		} else {
+			pdf = vertex_pdf(v, v->back, incoming);
+			previous->pdfReverse = pdf_area(vertex_pdf(v, incoming, v->back), v, previous);
+			// a dielectric picks its diffuse lobe by the fresnel term
+			// towards the camera, which is the other end for light
+			if (!camera && v->material->kind == MATERIAL_DIELECTRIC && pdf > 0.0f)
+				weight = vector3_scale(weight, vector3_all(dielectric_diffuse(v->material, incoming, v->normal) /
+					dielectric_diffuse(v->material, v->back, v->normal)));
+		}
+		beta = vector3_scale(vector3_scale(beta, weight), vector3_all(cosine));
+
+		ray.origin = v->point;
+		if (v->material->kind == MATERIAL_DIELECTRIC)
+			ray.origin = vector3_add(ray.origin, vector3_scale(incoming, vector3_all(1e-4)));
+		ray.direction = incoming;
+	}
+	if (camera)
+		*escaped = beta;
+	return count;
+}
+
+float remap0(float pdf) {
+	return pdf != 0.0f ? pdf : 1.0f;
+}
+
+// power heuristic weight of joining light[s - 1] to camera[t - 1] against
+// every other s' + t' = s + t. the joined ends get the densities they have
+// in this strategy, the rest keep the ones their walks gave them
+float bdpt_weight(const PathVertex *light, int s, const PathVertex *camera, int t) {
+	if (s + t == 2)
+		return 1.0f;
+
+	const PathVertex *z = &camera[t - 1];
+	const PathVertex *y = s ? &light[s - 1] : NULL;
+	float zReverse, zPreviousReverse = 0.0f, yReverse = 0.0f, yPreviousReverse = 0.0f;
+	if (s == 0) {
+		// a path that hit a light: how its own light would have started it
+		zReverse = emitter_pdf(z);
+		float cosine = vector3_dot_product(z->normal, z->back);
+		if (zReverse == 0.0f || cosine <= 0.0f)
+			return 1.0f;
+		zPreviousReverse = pdf_area(cosine * (float)M_1_PI, z, &camera[t - 2]);
+	} else {
+		Vector3 toCamera = vector3_normalized(vector3_subtract(z->point, y->point));
+		Vector3 toLight = vector3_scale(toCamera, vector3_all(-1.0f));
+		float pdf = s == 1 ? fmaxf(vector3_dot_product(y->normal, toCamera), 0.0f) * (float)M_1_PI
+			: vertex_pdf(y, y->back, toCamera);
+		zReverse = pdf_area(pdf, y, z);
+		if (t > 1) {
+			zPreviousReverse = pdf_area(vertex_pdf(z, toLight, z->back), z, &camera[t - 2]);
+			pdf = vertex_pdf(z, z->back, toLight);
+		} else {
+			int pixel;
+			camera_importance(toLight, &pdf, &pixel);
+		}
+		yReverse = pdf_area(pdf, z, y);
+		if (s > 1)
+			yPreviousReverse = pdf_area(vertex_pdf(y, toCamera, y->back), y, &light[s - 2]);
+	}
+
+	float sum = 0.0f;
+	float ratio = 1.0f;
+	for (int i = t - 1; i > 0; --i) {
+		float reverse = i == t - 1 ? zReverse : i == t - 2 ? zPreviousReverse : camera[i].pdfReverse;
+		ratio *= remap0(reverse) / remap0(camera[i].pdfForward);
+		if (!(i < t - 1 && camera[i].delta) && !camera[i - 1].delta)
+			sum += ratio * ratio;
+	}
+	ratio = 1.0f;
+	for (int i = s - 1; i >= 0; --i) {
+		float reverse = i == s - 1 ? yReverse : i == s - 2 ? yPreviousReverse : light[i].pdfReverse;
+		ratio *= remap0(reverse) / remap0(light[i].pdfForward);
+		if (!(i < s - 1 && light[i].delta) && !(i > 0 && light[i - 1].delta))
+			sum += ratio * ratio;
+	}
+	return 1.0f / (1.0f + sum);
+}
+
+// light[s - 1] and camera[t - 1] joined by a shadow ray, t > 1
+Vector3 bdpt_connect(const PathVertex *light, int s, const PathVertex *camera, int t) {
+	const PathVertex *y = &light[s - 1];
+	const PathVertex *z = &camera[t - 1];
+	Vector3 d = vector3_subtract(y->point, z->point);
+	float distance2 = vector3_dot_product(d, d);
+	Vector3 toLight = vector3_scale(d, vector3_all(1.0f / sqrtf(distance2)));
+	Vector3 toCamera = vector3_scale(toLight, vector3_all(-1.0f));
+
+	Vector3 result = vector3_scale(z->beta, vertex_brdf(z, z->back, toLight));
+	result = vector3_scale(result, s == 1 ? vertex_emitted(y, toCamera) : vertex_brdf(y, toCamera, y->back));
+	result = vector3_scale(result, y->beta);
+	float g = fabsf(vector3_dot_product(z->normal, toLight)) * fabsf(vector3_dot_product(y->normal, toLight)) / distance2;
+	if (g == 0.0f || (result.x == 0.0f && result.y == 0.0f && result.z == 0.0f))
+		return black;
+	if (!bdpt_visible(z->point, y->point))
+		return black;
+	return vector3_scale(result, vector3_all(g * bdpt_weight(light, s, camera, t)));
+}
+
+void film_splat_add(int pixel, Vector3 value) {
+	atomic_fetch_add_explicit(&film_splat[3 * pixel], (unsigned long)(value.x * SPLAT_FIXED + 0.5),
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&film_splat[3 * pixel + 1], (unsigned long)(value.y * SPLAT_FIXED + 0.5),
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&film_splat[3 * pixel + 2], (unsigned long)(value.z * SPLAT_FIXED + 0.5),
+		memory_order_relaxed);
+}
+
+// light[s - 1] seen straight from the camera, added to the pixel it lands on
+void bdpt_splat(const PathVertex *light, int s, const PathVertex *eye) {
+	const PathVertex *y = &light[s - 1];
+	Vector3 d = vector3_subtract(y->point, eye->point);
+	float distance2 = vector3_dot_product(d, d);
+	Vector3 toLight = vector3_scale(d, vector3_all(1.0f / sqrtf(distance2)));
+	Vector3 toCamera = vector3_scale(toLight, vector3_all(-1.0f));
+
+	float pdf;
+	int pixel;
+	float importance = camera_importance(toLight, &pdf, &pixel);
+	if (importance == 0.0f)
+		return;
+	Vector3 result = vector3_scale(y->beta, s == 1 ? vertex_emitted(y, toCamera) : vertex_brdf(y, toCamera, y->back));
+	float g = fabsf(vector3_dot_product(y->normal, toLight)) * vector3_dot_product(toLight, camera.forward) / distance2;
+	if (result.x == 0.0f && result.y == 0.0f && result.z == 0.0f)
+		return;
+	if (!bdpt_visible(y->point, eye->point))
+		return;
+	result = vector3_scale(result, vector3_all(g * importance * bdpt_weight(light, s, eye, 1)));
+	film_splat_add(pixel, result);
+}
+
+// one camera sample somewhere inside pixel x, y with its light subpath.
+// returns what belongs to this pixel, light tracing splats the rest
+Vector3 bdpt_sample(int x, int y) {
+	int stage = profile_enter(STAGE_TRACE);
+	PathVertex camera_path[BOUNCE_COUNT + 1];
+	PathVertex light_path[BOUNCE_COUNT];
+
+	float u[3];
+	sampler_next(u, 2);
+	Line ray = camera_ray_at(x + u[0], y + u[1]);
+	float cosine = vector3_dot_product(ray.direction, camera.forward);
+	camera_path[0] = (PathVertex){camera.origin, camera.forward, black, white, NULL, -1, 1.0f, 0.0f, 0};
+	Vector3 result = black;
+	int cameraCount = bdpt_walk(camera_path, 1, BOUNCE_COUNT + 1, ray,
+		1.0f / (film_area() * cosine * cosine * cosine), white, 1, &result);
+
+	int lightCount = 0;
+	if (emitter_count) {
+		float probability;
+		sampler_next(u, 3);
+		Sphere *sphere = &spheres[emitter_pick(u[0], &probability)];
+		Vector3 normal = vector3_around((Vector3){0.0f, 1.0f, 0.0f}, 1.0f - 2.0f * u[1], 2.0f * (float)M_PI * u[2]);
+		float pdf = probability / (4.0f * (float)M_PI * sphere->radius * sphere->radius);
+		light_path[0] = (PathVertex){vector3_add(sphere->center, vector3_scale(normal, vector3_all(sphere->radius))),
+			normal, black, vector3_all(1.0f / pdf), &materials[sphere->material], (int)(sphere - spheres), pdf,
+			0.0f, 0};
+		path_touched |= material_bit(sphere->material);
+
+		// cosine weighted, so the emitted radiance times pi is all that's left
+		sampler_next(u, 2);
+		ray.origin = vector3_add(sphere->center, vector3_scale(normal, vector3_all(sphere->radius * 1.0001f)));
+		ray.direction = vector3_around(normal, sqrtf(1.0f - u[0]), 2.0f * (float)M_PI * u[1]);
+		Vector3 beta = vector3_scale(light_path[0].beta, vector3_scale(light_path[0].material->emission,
+			vector3_all((float)M_PI)));
+		lightCount = bdpt_walk(light_path, 1, BOUNCE_COUNT, ray,
+			vector3_dot_product(normal, ray.direction) * (float)M_1_PI, beta, 0, NULL);
+	}
+
+	for (int t = 1; t <= cameraCount; ++t) {
+		const PathVertex *z = &camera_path[t - 1];
+		if (t > 1 && material_emits(z->material))
+			result = vector3_add(result, vector3_scale(vector3_scale(z->beta, z->material->emission),
+				vector3_all(bdpt_weight(light_path, 0, camera_path, t))));
+		for (int s = 1; s <= lightCount && s + t - 1 <= BOUNCE_COUNT; ++s) {
+			if (t == 1)
+				bdpt_splat(light_path, s, camera_path);
+			else
+				result = vector3_add(result, bdpt_connect(light_path, s, camera_path, t));
+		}
+	}
+
+	profile_leave(stage);
+	return result;
+}
+
+// running sums of one pixel, the film keeps them as separate arrays
+typedef struct {
+	Vector3 sum;
+	int samples;
+	double mean;
+	double m2;
+	uint64_t touched;
+} PixelSum;
+
+// reservoir resampled direct light (--restir, bitterli et al. 2020). the
+// path integrator's camera ray, and so its first hit, stays put across a
+// pixel's samples, so each pixel keeps a reservoir there: one light sample
+// out of all it has seen, with a weight that makes it an estimate of all
+// the direct light. every sample adds a few fresh candidates, cone sampled
+// towards emitters the light tree picks, and takes in the reservoirs of a
+// couple of neighbours as they were after the previous pass (or frame).
+// only the one picked gets a shadow ray. a sample only counts towards the
+// pixels that could have produced it, which keeps the estimate unbiased
+#define RESTIR_CANDIDATES 4
+#define RESTIR_NEIGHBOURS 2
+#define RESTIR_RADIUS 16
+// how many candidates the history may stand for, in units of one sample's
+#define RESTIR_HISTORY 20
+
+typedef struct {
+	// the surface it was gathered for, material NULL when there is none
+	PathVertex at;
+	// a point on a loose emitter, as the direction from its center
+	int sphere;
+	Vector3 direction;
+	// unbiased contribution weight, and how many candidates it stands for
+	float weight;
+	float count;
+} Reservoir;
+
+int restir = 0;
+Reservoir *reservoirs;
+// as they were after the previous pass, for the neighbours to read
+Reservoir *reservoirs_previous;
+
+void restir_init() {
+	free(reservoirs);
+	free(reservoirs_previous);
+	reservoirs = calloc(pixel_count, sizeof(Reservoir));
+	reservoirs_previous = calloc(pixel_count, sizeof(Reservoir));
+	assert(reservoirs && reservoirs_previous);
+}
+
+// the unshadowed direct light the sample brings to at, and the solid angle
+// per unit of the light's area it's seen under
+Vector3 restir_light(const PathVertex *at, int sphere, Vector3 direction, Vector3 *point, float *solidAngle) {
+	const Sphere *light = &spheres[sphere];
+	*point = vector3_add(light->center, vector3_scale(direction, vector3_all(light->radius)));
+	Vector3 d = vector3_subtract(*point, at->point);
+	float distance2 = vector3_dot_product(d, d);
+	Vector3 toLight = vector3_scale(d, vector3_all(1.0f / sqrtf(distance2)));
+	float cosLight = -vector3_dot_product(direction, toLight);
+	*solidAngle = cosLight / distance2;
+	if (cosLight <= 0.0f)
+		return black;
+	Vector3 brdf = vertex_brdf(at, at->back, toLight);
+	float cosAt = vector3_dot_product(at->normal, toLight);
+	return vector3_scale(vector3_scale(brdf, materials[light->material].emission), vector3_all(cosAt * *solidAngle));
+}
+
+float restir_target(Vector3 light) {
+	return 0.2126f * light.x + 0.7152f * light.y + 0.0722f * light.z;
+}
+
+// a candidate on an emitter from the light tree, in the cone at sees it
+// under. returns its resampling weight, the target over the density of
+// having picked that point per unit of the light's area
+float restir_candidate(const PathVertex *at, const float *u, int *sphere, Vector3 *direction) {
+	float probability;
+	*sphere = light_pick(at->point, at->normal, u[0], &probability);
+	if (*sphere < 0)
+		return 0.0f;
+	const Sphere *light = &spheres[*sphere];
+	Vector3 toCenter = vector3_subtract(light->center, at->point);
+	float distance2 = vector3_dot_product(toCenter, toCenter);
+	float radius2 = light->radius * light->radius;
+	if (distance2 <= radius2)
+		return 0.0f;
+
+	// 1 - cos theta kept apart so small lights don't lose it to rounding
+	float distance = sqrtf(distance2);
+	float sinMax2 = radius2 / distance2;
+	float oneMinusCosMax = sinMax2 / (1.0f + sqrtf(1.0f - sinMax2));
+	float t = u[1] * oneMinusCosMax;
+	float cosTheta = 1.0f - t;
+	float sinTheta2 = t * (2.0f - t);
+	float along = distance * cosTheta - sqrtf(fmaxf(0.0f, radius2 - distance2 * sinTheta2));
+	float cosAlpha = (distance2 + radius2 - along * along) / (2.0f * distance * light->radius);
+	Vector3 back = vector3_scale(toCenter, vector3_all(-1.0f / distance));
+	*direction = vector3_around(back, fminf(1.0f, cosAlpha), 2.0f * (float)M_PI * u[2]);
+
+	Vector3 point;
+	float solidAngle;
+	float target = restir_target(restir_light(at, *sphere, *direction, &point, &solidAngle));
+	float pdf = probability * solidAngle / (2.0f * (float)M_PI * oneMinusCosMax);
+	return pdf > 0.0f ? target / pdf : 0.0f;
+}
+
+// reservoirs of surfaces this far apart don't help each other
+int restir_similar(const PathVertex *a, const PathVertex *b) {
+	if (!b->material || vector3_dot_product(a->normal, b->normal) < 0.9f)
+		return 0;
+	float depthA = vector3_length(vector3_subtract(a->point, camera.origin));
+	float depthB = vector3_length(vector3_subtract(b->point, camera.origin));
+	return fabsf(depthA - depthB) < 0.1f * depthA;
+}
+
+// streaming weighted reservoir sampling: whether the input of this weight
+// replaces the one kept so far
+int restir_update(float *total, float weight, float u) {
+	*total += weight;
+	return weight > 0.0f && u * *total < weight;
+}
+
+// the direct light at, the first surface of pixel x, y, gets from the
+// pixel's reservoir, which takes in this sample's candidates
+Vector3 restir_sample(const PathVertex *at, int x, int y) {
+	Reservoir *reservoir = &reservoirs[y * image_width + x];
+	float u[4];
+	float total = 0.0f;
+	int sphere = -1;
+	Vector3 direction = black;
+	for (int i = 0; i < RESTIR_CANDIDATES; ++i) {
+		int s;
+		Vector3 d;
+		sampler_next(u, 4);
+		if (restir_update(&total, restir_candidate(at, u, &s, &d), u[3])) {
+			sphere = s;
+			direction = d;
+		}
+	}
+
+	// neighbours that look alike, then the pixel's own history
+	const Reservoir *inputs[1 + RESTIR_NEIGHBOURS];
+	int inputCount = 0;
+	if (reservoir->count > 0.0f && restir_similar(at, &reservoir->at))
+		inputs[inputCount++] = reservoir;
+	for (int i = 0; i < RESTIR_NEIGHBOURS; ++i) {
+		sampler_next(u, 3);
+		int nx = x + (int)floorf((2.0f * u[0] - 1.0f) * RESTIR_RADIUS + 0.5f);
+		int ny = y + (int)floorf((2.0f * u[1] - 1.0f) * RESTIR_RADIUS + 0.5f);
+		if (nx < 0 || nx >= image_width || ny < 0 || ny >= image_height || (nx == x && ny == y))
+			continue;
+		const Reservoir *neighbour = &reservoirs_previous[ny * image_width + nx];
+		if (neighbour->count == 0.0f || !restir_similar(at, &neighbour->at))
+			continue;
+		inputs[inputCount++] = neighbour;
+		if (neighbour->sphere < 0)
+			continue;
+		Vector3 point;
+		float solidAngle;
+		float target = restir_target(restir_light(at, neighbour->sphere, neighbour->direction, &point, &solidAngle));
+		float count = fminf(neighbour->count, RESTIR_HISTORY * RESTIR_CANDIDATES);
+		if (restir_update(&total, target * neighbour->weight * count, u[2])) {
+			sphere = neighbour->sphere;
+			direction = neighbour->direction;
+		}
+	}
+	// and what the pixel had gathered before
+	if (inputCount && inputs[0] == reservoir && reservoir->sphere >= 0) {
+		Vector3 point;
+		float solidAngle;
+		float target = restir_target(restir_light(at, reservoir->sphere, reservoir->direction, &point, &solidAngle));
+		float count = fminf(reservoir->count, RESTIR_HISTORY * RESTIR_CANDIDATES);
+		sampler_next(u, 1);
+		if (restir_update(&total, target * reservoir->weight * count, u[0])) {
+			sphere = reservoir->sphere;
+			direction = reservoir->direction;
+		}
+	}
+
+	// everything that was taken in stands for its candidates, but only those
+	// that could have picked the sample count towards normalizing it
+	float count = RESTIR_CANDIDATES;
+	float normalization = RESTIR_CANDIDATES;
+	for (int i = 0; i < inputCount; ++i) {
+		float share = fminf(inputs[i]->count, RESTIR_HISTORY * RESTIR_CANDIDATES);
+		count += share;
+		Vector3 point;
+		float solidAngle;
+		if (sphere >= 0 && restir_target(restir_light(&inputs[i]->at, sphere, direction, &point, &solidAngle)) > 0.0f)
+			normalization += share;
+	}
+
+	Vector3 result = black;
+	float weight = 0.0f;
+	if (sphere >= 0) {
+		Vector3 point;
+		float solidAngle;
+		Vector3 light = restir_light(at, sphere, direction, &point, &solidAngle);
+		weight = total / (normalization * restir_target(light));
+		if (bdpt_visible(at->point, point))
+			result = vector3_scale(light, vector3_all(weight));
+	}
+
+	reservoir->at = *at;
+	reservoir->sphere = sphere;
+	reservoir->direction = direction;
+	reservoir->weight = weight;
+	reservoir->count = fminf(count, RESTIR_HISTORY * RESTIR_CANDIDATES);
+	return result;
+}
+
+// add count samples to a pixel, numbered from firstSample on so any
+// process rendering the same sample numbers gets the same values
+void render_pixel(int x, int y, int firstSample, int count, PixelSum *pixel) {
+	int index = y * image_width + x;
+	Line ray = camera_ray(x, y);
+	Hit primary = scene_intersect(ray);
+
+	film_primary[index] = primary.sphere;
+	film_depth[index] = primary.distance;
+
+	// direct light from reservoirs needs a surface without delta lobes
+	PathVertex at = {0};
+	if (restir && emitter_count && primary.sphere >= 0 && materials[hit_sphere(primary)->material].kind != MATERIAL_DIELECTRIC)
+		at = (PathVertex){primary.point, primary.normal, vector3_scale(ray.direction, vector3_all(-1.0f)), white,
+			&materials[hit_sphere(primary)->material], primary.instance < 0 ? primary.sphere : -1, 0.0f, 0.0f, 0};
+	else if (restir)
+		reservoirs[index].count = 0.0f;
+
+	path_touched = 0;
+	path_lit = at.material != NULL;
+	for (int i = 0; i < count; ++i) {
+		sampler_start(index, x, y, firstSample + i);
+		Vector3 sample;
+		if (integrator == INTEGRATOR_BDPT) {
+			sample = bdpt_sample(x, y);
+		} else {
+			sample = path_lit ? restir_sample(&at, x, y) : black;
+			sample = vector3_add(sample, ray_trace_from(ray, primary));
+		}
+		pixel->sum = vector3_add(pixel->sum, sample);
+
+		double luminance = 0.2126 * sample.x + 0.7152 * sample.y + 0.0722 * sample.z;
+		double delta = luminance - pixel->mean;
+		pixel->samples += 1;
+		pixel->mean += delta / pixel->samples;
+		pixel->m2 += delta * (luminance - pixel->mean);
+	}
+	pixel->touched |= path_touched;
+	path_lit = 0;
+}
+
+void render_tile(int tile) {
+	int x0, y0, x1, y1;
+	tile_bounds(tile, &x0, &y0, &x1, &y1);
+
+	for (int y = y0; y < y1; ++y) {
+		for (int x = x0; x < x1; ++x) {
+			int index = y * image_width + x;
+			if (!pass_plan[index])
+				continue;
+
+			// out of time: pixels keep the samples they have so far and
+			// whatever is left in pass_plan can be picked up again later
+			if (time_now() >= pass_deadline || stop_requested)
+				return;
+
+			PixelSum pixel = {film[index], film_samples[index], film_mean[index], film_m2[index], film_touched[index]};
+			render_pixel(x, y, film_samples[index], pass_plan[index], &pixel);
+
+			film[index] = pixel.sum;
+			film_samples[index] = pixel.samples;
+			film_mean[index] = pixel.mean;
+			film_m2[index] = pixel.m2;
+			film_touched[index] = pixel.touched;
+			pass_plan[index] = 0;
+		}
+	}
+}
+
+// render threads are started once and woken up for every pass, so a
+// sequence of frames or service requests doesn't start threads each time.
+// a run hands out the items 0 .. pool_item_count - 1 of one job
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+pthread_t pool_threads[MAX_THREADS];
+int pool_size = 0;
+int pool_generation = 0;
+int pool_start_generation = 0;
+int pool_busy = 0;
+int pool_quit = 0;
+void (*pool_job)(int item);
+const char *pool_job_name;
+int pool_item_count;
+atomic_int pool_next_item;
+
+void *pool_worker(void *arg) {
+	thread_index = (int)(intptr_t)arg;
+
+	pthread_mutex_lock(&pool_mutex);
+	int generation = pool_start_generation;
+	for (;;) {
+		while (!pool_quit && pool_generation == generation)
+			pthread_cond_wait(&pool_wake, &pool_mutex);
+		if (pool_quit)
+			break;
+		generation = pool_generation;
+		pthread_mutex_unlock(&pool_mutex);
+
+		counters_thread_start();
+		for (;;) {
+			int item = atomic_fetch_add(&pool_next_item, 1);
+			if (item >= pool_item_count)
+				break;
+
+			uint64_t begin = trace_begin();
+			pool_job(item);
+			trace_end(pool_job_name, begin, item);
+		}
+		counters_thread_stop();
+
+		pthread_mutex_lock(&pool_mutex);
+		if (--pool_busy == 0)
+			pthread_cond_signal(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+void pool_stop() {
+	pthread_mutex_lock(&pool_mutex);
+	pool_quit = 1;
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_mutex);
+	for (int t = 0; t < pool_size; ++t)
+		pthread_join(pool_threads[t], NULL);
+	pool_size = 0;
+	pool_quit = 0;
+}
+
+void pool_run(int threadCount, const char *name, void (*job)(int item), int count) {
+	if (pool_size != threadCount) {
+		pool_stop();
+		// new workers wait for the generation after this one, however late
+		// they get to look at it
+		pool_start_generation = pool_generation;
+		for (; pool_size < threadCount; ++pool_size)
+			pthread_create(&pool_threads[pool_size], NULL, pool_worker, (void *)(intptr_t)(pool_size + 1));
+	}
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_job = job;
+	pool_job_name = name;
+	pool_item_count = count;
+	atomic_store(&pool_next_item, 0);
+	pool_generation += 1;
+	pool_busy = pool_size;
+	pthread_cond_broadcast(&pool_wake);
+	while (pool_busy)
+		pthread_cond_wait(&pool_done, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+// items moved but are still the same ones: refit every box bottom up, in
+// parallel over subtrees for big trees, then rebuild the topmost subtrees
+// whose cost grew past BVH_REBUILD_RATIO times their cost at build time.
+// returns 0 when refitting was enough, 1 after a partial and 2 after a
+// full rebuild
+Bvh *bvh_refitting;
+int bvh_cut[4 * MAX_THREADS];
+
+void bvh_refit_job(int item) {
+	bvh_refit_subtree(bvh_refitting, bvh_cut[item]);
+}
+
+// returns the number of subtrees rebuilt below node
+int bvh_repair(Bvh *bvh, int node, int depth) {
+	BvhNode *n = &bvh->nodes[node];
+	if (!n->worse)
+		return 0;
+
+	if (bvh_cost(bvh, node) > BVH_REBUILD_RATIO * n->cost) {
+		int subtreeDepth = bvh_build_node(bvh, node, n->first, n->count);
+		bvh->depth = depth + subtreeDepth > bvh->depth ? depth + subtreeDepth : bvh->depth;
+		return 1;
+	}
+
+	// the box stays the same when the items under it are only regrouped,
+	// but its area total shrinks
+	int rebuilt = bvh_repair(bvh, node + 1, depth + 1) + bvh_repair(bvh, bvh_right(bvh, node), depth + 1);
+	bvh_refit_node(bvh, node);
+	return rebuilt;
+}
+
+int bvh_update(Bvh *bvh, int threadCount) {
+	if (!bvh->count)
+		return 0;
+
+	if (bvh->count < BVH_PARALLEL_REFIT || threadCount < 2) {
+		bvh_refit_subtree(bvh, 0);
+	} else {
+		// split the biggest subtree until there are a few per thread, the
+		// nodes above the cut are refit afterwards in reverse split order
+		int above[4 * MAX_THREADS];
+		int cutCount = 1, aboveCount = 0;
+		bvh_cut[0] = 0;
+		while (cutCount < 4 * threadCount) {
+			int biggest = 0;
+			for (int i = 1; i < cutCount; ++i)
+				if (bvh->nodes[bvh_cut[i]].count > bvh->nodes[bvh_cut[biggest]].count)
+					biggest = i;
+			int node = bvh_cut[biggest];
+			if (bvh->nodes[node].count == 1)
+				break;
+			above[aboveCount++] = node;
+			bvh_cut[biggest] = node + 1;
+			bvh_cut[cutCount++] = bvh_right(bvh, node);
+		}
+		bvh_refitting = bvh;
+		pool_run(threadCount, "refit", bvh_refit_job, cutCount);
+		for (int i = aboveCount - 1; i >= 0; --i)
+			bvh_refit_node(bvh, above[i]);
+	}
+
+	if (!bvh->nodes[0].worse)
+		return 0;
+	int full = bvh_cost(bvh, 0) > BVH_REBUILD_RATIO * bvh->nodes[0].cost;
+	bvh_repair(bvh, 0, 0);
+	return full ? 2 : 1;
+}
+
+// after loose spheres moved or instances were placed elsewhere. objects
+// never change, so only the two upper trees are touched
+int scene_bvh_update(int threadCount, int spheresMoved, int instancesMoved) {
+	int spheresResult = 0, instancesResult = 0;
+	if (spheresMoved) {
+		sphere_bounds();
+		spheresResult = bvh_update(sphere_bvh, threadCount);
+	}
+	if (instancesMoved) {
+		instance_bounds();
+		instancesResult = bvh_update(instance_bvh, threadCount);
+	}
+	return spheresResult > instancesResult ? spheresResult : instancesResult;
+}
+
+// the photon pass. every photon has its own sample number, so the map
+// doesn't depend on how many threads trace it, and each chunk of
+// PHOTON_CHUNK photons writes its own part of photon_trace_buffer
+Photon *photon_trace_buffer;
+int *photon_chunk_counts;
+
+// a photon leaves a point picked by area on an emitter chosen by power,
+// in a cosine weighted direction, and is kept where it comes to rest on a
+// surface without delta lobes after at least one delta bounce
+void photon_job(int chunk) {
+	int first = chunk * PHOTON_CHUNK;
+	int last = first + PHOTON_CHUNK < photon_emit ? first + PHOTON_CHUNK : photon_emit;
+	int stored = 0;
+	for (int i = first; i < last; ++i) {
+		// a pixel number no pixel has
+		sampler_start(UINT32_MAX, 0, 0, i);
+		float u[3], probability;
+		sampler_next(u, 3);
+		Sphere *sphere = &spheres[emitter_pick(u[0], &probability)];
+		const Material *light = &materials[sphere->material];
+		Vector3 normal = vector3_around((Vector3){0.0f, 1.0f, 0.0f}, 1.0f - 2.0f * u[1], 2.0f * (float)M_PI * u[2]);
+
+		// emitted radiance times pi times area is the emitter's flux, and
+		// each photon carries its share of it
+		float area = 4.0f * (float)M_PI * sphere->radius * sphere->radius;
+		Vector3 power = vector3_scale(light->emission, vector3_all((float)M_PI * area / (probability * photon_emit)));
+		uint64_t touched = material_bit(sphere->material);
+
+		sampler_next(u, 2);
+		Line ray;
+		ray.origin = vector3_add(sphere->center, vector3_scale(normal, vector3_all(sphere->radius * 1.0001f)));
+		ray.direction = vector3_around(normal, sqrtf(1.0f - u[0]), 2.0f * (float)M_PI * u[1]);
+
+		int deltas = 0;
+		for (int bounce = 0; bounce < BOUNCE_COUNT; ++bounce) {
+			Hit hit = scene_intersect(ray);
+			if (hit.sphere < 0)
+				break;
+			int index = hit_sphere(hit)->material;
+			const Material *material = &materials[index];
+			touched |= material_bit(index);
+			Vector3 outgoing = vector3_scale(ray.direction, vector3_all(-1.0f));
+			if (material->kind != MATERIAL_DIELECTRIC) {
+				if (deltas)
+					photon_trace_buffer[first + stored++] = (Photon){hit.point, outgoing, power, touched};
+				break;
+			}
+
+			Vector3 incoming;
+			float cosine;
+			int delta;
+			Vector3 weight = material_sample(material, outgoing, hit.normal, &incoming, &cosine, &delta);
+			// the diffuse part of a dielectric takes no photons
+			if (!delta)
+				break;
+			deltas += 1;
+			power = vector3_scale(power, weight);
+			ray.origin = vector3_add(hit.point, vector3_scale(incoming, vector3_all(1e-4)));
+			ray.direction = incoming;
+		}
+	}
+	photon_chunk_counts[chunk] = stored;
+}
+
+void photon_free() {
+	free(photons);
+	free(photon_cells);
+	photons = NULL;
+	photon_cells = NULL;
+	photon_count = 0;
+}
+
+// trace photon_emit photons and file the ones kept by grid cell. scenes
+// without emissive spheres end up with an empty map
+void photon_build(int threadCount) {
+	uint64_t start = time_now();
+	photon_free();
+
+	emitters_build();
+
+	int chunks = (photon_emit + PHOTON_CHUNK - 1) / PHOTON_CHUNK;
+	if (emitter_count) {
+		photon_trace_buffer = malloc((size_t)photon_emit * sizeof(Photon));
+		photon_chunk_counts = malloc(chunks * sizeof(int));
+		assert(photon_trace_buffer && photon_chunk_counts);
+		pool_run(threadCount, "photons", photon_job, chunks);
+		for (int chunk = 0; chunk < chunks; ++chunk) {
+			memmove(&photon_trace_buffer[photon_count], &photon_trace_buffer[chunk * PHOTON_CHUNK],
+				photon_chunk_counts[chunk] * sizeof(Photon));
+			photon_count += photon_chunk_counts[chunk];
+		}
+		free(photon_chunk_counts);
+	}
+
+	// counting sort by bucket, twice as many buckets as photons
+	photon_buckets = 1024;
+	while (photon_buckets < 2u * (uint32_t)photon_count)
+		photon_buckets *= 2;
+	photon_cells = calloc(photon_buckets + 1, sizeof(int));
+	photons = malloc((photon_count ? photon_count : 1) * sizeof(Photon));
+	assert(photon_cells && photons);
+	for (int i = 0; i < photon_count; ++i) {
+		int cell[3];
+		photon_cell(photon_trace_buffer[i].position, cell);
+		photon_cells[photon_bucket(cell) + 1] += 1;
+	}
+	for (uint32_t b = 0; b < photon_buckets; ++b)
+		photon_cells[b + 1] += photon_cells[b];
+	for (int i = 0; i < photon_count; ++i) {
+		int cell[3];
+		photon_cell(photon_trace_buffer[i].position, cell);
+		photons[photon_cells[photon_bucket(cell)]++] = photon_trace_buffer[i];
+	}
+	// the scatter moved every start to the next bucket's
+	for (uint32_t b = photon_buckets; b > 0; --b)
+		photon_cells[b] = photon_cells[b - 1];
+	photon_cells[0] = 0;
+	free(photon_trace_buffer);
+	photon_trace_buffer = NULL;
+
+	fprintf(stderr, "photons: %d of %d kept in %.2f s\n", photon_count, photon_emit, (time_now() - start) / 1e9);
+}
+
+// the learned histograms to the cdfs the next pass samples, a run of
+// buckets per item
+#define GUIDE_UPDATE_CHUNK 64
+
+void guide_update_job(int chunk) {
+	for (int bucket = chunk * GUIDE_UPDATE_CHUNK; bucket < (chunk + 1) * GUIDE_UPDATE_CHUNK; ++bucket) {
+		atomic_ulong *learned = &guide_learned[bucket * GUIDE_BINS];
+		float *cdf = &guide_cdf[bucket * GUIDE_STRIDE];
+		double rows[GUIDE_RESOLUTION];
+		double total = 0.0;
+		for (int row = 0; row < GUIDE_RESOLUTION; ++row) {
+			float *columns = &cdf[GUIDE_RESOLUTION + row * GUIDE_RESOLUTION];
+			double sum = 0.0;
+			for (int column = 0; column < GUIDE_RESOLUTION; ++column) {
+				sum += (double)atomic_load_explicit(&learned[row * GUIDE_RESOLUTION + column], memory_order_relaxed);
+				columns[column] = (float)sum;
+			}
+			// rows nothing was learned for are never picked
+			for (int column = 0; column < GUIDE_RESOLUTION; ++column)
+				columns[column] = sum > 0.0 ? (float)(columns[column] / sum) : 0.0f;
+			total += sum;
+			rows[row] = total;
+		}
+		for (int row = 0; row < GUIDE_RESOLUTION; ++row)
+			cdf[row] = total > 0.0 ? (float)(rows[row] / total) : 0.0f;
+		if (total > 0.0)
+			cdf[GUIDE_RESOLUTION - 1] = 1.0f;
+	}
+}
+
+void guide_update(int threadCount) {
+	uint64_t begin = trace_begin();
+	pool_run(threadCount, "guide update", guide_update_job, GUIDE_BUCKETS / GUIDE_UPDATE_CHUNK);
+	trace_end("guide update", begin, -1);
+}
+
+// the learned sums to the means the next pass reads, a run of slots per item
+#define RADIANCE_UPDATE_CHUNK 4096
+
+void radiance_update_job(int chunk) {
+	for (int slot = chunk * RADIANCE_UPDATE_CHUNK; slot < (chunk + 1) * RADIANCE_UPDATE_CHUNK; ++slot) {
+		atomic_ulong *learned = &radiance_learned[4 * slot];
+		float *cached = &radiance_cached[4 * slot];
+		unsigned long count = atomic_load_explicit(&learned[3], memory_order_relaxed);
+		for (int c = 0; c < 3; ++c)
+			cached[c] = count ? (float)(atomic_load_explicit(&learned[c], memory_order_relaxed)
+				/ (RADIANCE_FIXED * (double)count)) : 0.0f;
+		cached[3] = count >= RADIANCE_MIN_SAMPLES;
+	}
+}
+
+void radiance_update(int threadCount) {
+	uint64_t begin = trace_begin();
+	pool_run(threadCount, "radiance update", radiance_update_job, RADIANCE_SLOTS / RADIANCE_UPDATE_CHUNK);
+	trace_end("radiance update", begin, -1);
+}
+
+// relative standard error of a pixel's mean luminance, dark pixels are
+// measured against a floor so black shadows don't look infinitely noisy
+double pixel_error(int pixel) {
+	int n = film_samples[pixel];
+	if (n < 2)
+		return INFINITY;
+	double mean = film_mean[pixel] > 0.01 ? film_mean[pixel] : 0.01;
+	return sqrt(film_m2[pixel] / (n - 1) / n) / mean;
+}
+
+// uniform passes bring every pixel up to goal samples. adaptive passes only go to
+// pixels whose error is still above the threshold, and split a budget the
+// size of everything spent so far in proportion to that error, so the
+// samples converged pixels don't take pile up on the noisiest ones.
+// returns the number of samples planned
+long plan_pass(int passIndex, int goal, double threshold, long budget) {
+	long planned = 0;
+
+	if (threshold <= 0.0 || passIndex == 0) {
+		for (int i = 0; i < pixel_count; ++i) {
+			pass_plan[i] = in_region(i) && film_samples[i] < goal ? goal - film_samples[i] : 0;
+			planned += pass_plan[i];
+		}
+		return planned;
+	}
+
+	double errorSum = 0.0;
+	for (int i = 0; i < pixel_count; ++i) {
+		double error = pixel_error(i);
+		if (in_region(i) && error > threshold)
+			errorSum += error;
+	}
+
+	for (int i = 0; i < pixel_count; ++i) {
+		double error = pixel_error(i);
+		int n = 0;
+		if (in_region(i) && error > threshold) {
+			double share = budget * (error / errorSum);
+			n = share < film_samples[i] ? (int)ceil(share) : film_samples[i];
+		}
+		pass_plan[i] = n;
+		planned += n;
+	}
+
+	return planned;
+}
+
+void render_pass(int threadCount, uint64_t deadline) {
+	pass_deadline = deadline;
+	pool_run(threadCount, "tile", render_tile, tile_count);
+	if (restir)
+		memcpy(reservoirs_previous, reservoirs, pixel_count * sizeof(Reservoir));
+}
+
+// sums and counts to 8 bit pixels, into any buffers so an encoder can work
+// on a copy of the film while the next frame renders
+void tone_map_pixels(const Vector3 *sums, const int *samples, Color8 *pixels) {
+	int stage = profile_enter(STAGE_TONEMAP);
+	for (int i = 0; i < pixel_count; ++i) {
+		Vector3 color = sums[i];
+		if (samples[i])
+			color = vector3_scale(color, vector3_all(1.0f / (float)samples[i]));
+
+		color.x = color.x / (color.x + 1.0f);
+		color.y = color.y / (color.y + 1.0f);
+		color.z = color.z / (color.z + 1.0f);
+
+		color.x = fast_gamma(color.x);
+		color.y = fast_gamma(color.y);
+		color.z = fast_gamma(color.z);
+
+		Color8 pixel;
+		pixel.r = 0.0 < color.x ? color.x < 1.0 ? (uint8_t)(255.0 * color.x) : 255 : 0;
+		pixel.g = 0.0 < color.y ? color.y < 1.0 ? (uint8_t)(255.0 * color.y) : 255 : 0;
+		pixel.b = 0.0 < color.z ? color.z < 1.0 ? (uint8_t)(255.0 * color.z) : 255 : 0;
+
+		pixels[i] = pixel;
+	}
+	profile_leave(stage);
+}
+
+// every camera sample of the bidirectional integrator also sent out one
+// light subpath, and what those splat anywhere on the film is averaged
+// over as many samples as a pixel got on average. a metropolis film is
+// nothing but splats, worth mlt_scale each
+void tone_map() {
+	if (integrator == INTEGRATOR_PATH) {
+		tone_map_pixels(film, film_samples, image);
+		return;
+	}
+
+	double paths = 0.0;
+	for (int i = 0; i < pixel_count; ++i)
+		paths += film_samples[i];
+	Vector3 *sums = malloc(pixel_count * sizeof(Vector3));
+	assert(sums);
+	for (int i = 0; i < pixel_count; ++i) {
+		double scale = integrator == INTEGRATOR_MLT ? mlt_scale
+			: paths > 0.0 ? (film_samples[i] ? film_samples[i] : 1) * (double)pixel_count / paths : 0.0;
+		scale /= SPLAT_FIXED;
+		Vector3 splat = {(float)(atomic_load(&film_splat[3 * i]) * scale),
+			(float)(atomic_load(&film_splat[3 * i + 1]) * scale), (float)(atomic_load(&film_splat[3 * i + 2]) * scale)};
+		sums[i] = vector3_add(film[i], splat);
+	}
+	tone_map_pixels(sums, film_samples, image);
+	free(sums);
+}
+
+int pass_remaining() {
+	for (int i = 0; i < pixel_count; ++i)
+		if (pass_plan[i])
+			return 1;
+	return 0;
+}
+
+int film_write(FILE *file) {
+	return fwrite(film, sizeof(film[0]), pixel_count, file) == pixel_count
+		&& fwrite(film_samples, sizeof(film_samples[0]), pixel_count, file) == pixel_count
+		&& fwrite(film_mean, sizeof(film_mean[0]), pixel_count, file) == pixel_count
+		&& fwrite(film_m2, sizeof(film_m2[0]), pixel_count, file) == pixel_count;
+}
+
+int film_read(FILE *file) {
+	return fread(film, sizeof(film[0]), pixel_count, file) == pixel_count
+		&& fread(film_samples, sizeof(film_samples[0]), pixel_count, file) == pixel_count
+		&& fread(film_mean, sizeof(film_mean[0]), pixel_count, file) == pixel_count
+		&& fread(film_m2, sizeof(film_m2[0]), pixel_count, file) == pixel_count;
+}
+
+// finish a file written to temporary and move it to path in one step. the
+// data is synced first so a crash can't leave a renamed but empty file
+int file_commit(FILE *file, const char *temporary, const char *path, int ok) {
+	ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		remove(temporary);
+		return 0;
+	}
+	return rename(temporary, path) == 0;
+}
+
+// checkpoint file layout: header, Progress, then film, film_samples,
+// film_mean, film_m2 and pass_plan as raw arrays. samples are seeded by
+// pixel and sample index, so film_samples doubles as the rng position and
+// a resumed render is bit-identical to one that was never interrupted
+#define CHECKPOINT_MAGIC "RTCKPT07"
+
+typedef struct {
+	char magic[8];
+	int32_t width;
+	int32_t height;
+	int32_t targetSamples;
+	double threshold;
+	uint64_t scene;
+} CheckpointHeader;
+
+int write_checkpoint(const char *path, int targetSamples, double threshold, Progress *progress) {
+	char temporary[4096];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+	FILE *file = fopen(temporary, "wb");
+	if (!file)
+		return 0;
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.width = image_width;
+	header.height = image_height;
+	header.targetSamples = targetSamples;
+	header.threshold = threshold;
+	header.scene = frame_hash();
+
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(progress, sizeof(*progress), 1, file) == 1
+		&& film_write(file)
+		&& fwrite(pass_plan, sizeof(pass_plan[0]), pixel_count, file) == pixel_count;
+
+	return file_commit(file, temporary, path, ok);
+}
+
+int read_checkpoint(const char *path, int targetSamples, double threshold, Progress *progress) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "could not open checkpoint %s\n", path);
+		return 0;
+	}
+
+	CheckpointHeader header;
+	int ok = fread(&header, sizeof(header), 1, file) == 1;
+	if (ok && (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))
+		|| header.width != image_width || header.height != image_height)) {
+		fprintf(stderr, "%s is not a checkpoint of a %dx%d render\n", path, image_width, image_height);
+		fclose(file);
+		return 0;
+	}
+	if (ok && header.scene != frame_hash()) {
+		fprintf(stderr, "%s is a checkpoint of a different scene\n", path);
+		fclose(file);
+		return 0;
+	}
+	if (ok && (header.targetSamples != targetSamples || header.threshold != threshold)) {
+		fprintf(stderr, "%s was rendered with --spp %d --adaptive %g, resume with the same settings\n",
+			path, header.targetSamples, header.threshold);
+		fclose(file);
+		return 0;
+	}
+
+	ok = ok && fread(progress, sizeof(*progress), 1, file) == 1
+		&& film_read(file)
+		&& fread(pass_plan, sizeof(pass_plan[0]), pixel_count, file) == pixel_count;
+	fclose(file);
+
+	if (!ok)
+		fprintf(stderr, "checkpoint %s is truncated\n", path);
+	return ok;
+}
+
+// content-addressed result cache (--cache DIR). films are stored under a
+// hash of everything that decides their pixels except the sample count,
+// so a cached film with fewer samples than asked for is simply topped up:
+// samples are numbered per pixel and are summed in order, so topping up
+// gives exactly the film a render from scratch would have.
+// bump CACHE_VERSION whenever a change to the integrator or the material
+// model changes images, and CHECKPOINT_MAGIC and NET_MAGIC with it, since
+// checkpoints and workers are only compatible with the same samples
+#define CACHE_VERSION 5
+#define CACHE_MAGIC "RTFILM01"
+
+typedef struct {
+	char magic[8];
+	uint64_t key;
+	int32_t width;
+	int32_t height;
+} CacheHeader;
+
+uint64_t render_key() {
+	int32_t settings[] = {
+		CACHE_VERSION, BOUNCE_COUNT, image_width, image_height,
+		region_x0, region_y0, region_x1, region_y1
+	};
+	uint64_t frame = frame_hash();
+	uint64_t hash = hash_bytes(HASH_SEED, settings, sizeof(settings));
+	return hash_bytes(hash, &frame, sizeof(frame));
+}
+
+void cache_path(char *path, size_t size, const char *directory, uint64_t key) {
+	snprintf(path, size, "%s/%016llx.film", directory, (unsigned long long)key);
+}
+
+// fewest samples any pixel of the region has
+int region_samples() {
+	int result = INT32_MAX;
+	for (int i = 0; i < pixel_count; ++i)
+		if (in_region(i) && film_samples[i] < result)
+			result = film_samples[i];
+	return result == INT32_MAX ? 0 : result;
+}
+
+// loads the cached film into the (cleared) film, returns its samples per
+// pixel or 0 on a miss
+int cache_load(const char *directory) {
+	char path[4096];
+	uint64_t key = render_key();
+	cache_path(path, sizeof(path), directory, key);
+
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	CacheHeader header;
+	int ok = fread(&header, sizeof(header), 1, file) == 1
+		&& !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic))
+		&& header.key == key && header.width == image_width && header.height == image_height
+		&& film_read(file);
+	fclose(file);
+
+	if (!ok) {
+		memset(film, 0, pixel_count * sizeof(film[0]));
+		memset(film_samples, 0, pixel_count * sizeof(film_samples[0]));
+		memset(film_mean, 0, pixel_count * sizeof(film_mean[0]));
+		memset(film_m2, 0, pixel_count * sizeof(film_m2[0]));
+		return 0;
+	}
+	return region_samples();
+}
+
+// keep whichever film has more samples, so a cheap preview never replaces
+// an expensive final
+int cache_store(const char *directory) {
+	char path[4096], temporary[4096];
+	uint64_t key = render_key();
+	cache_path(path, sizeof(path), directory, key);
+
+	FILE *file = fopen(path, "rb");
+	if (file) {
+		CacheHeader header;
+		int samples = 0;
+		if (fread(&header, sizeof(header), 1, file) == 1 && header.key == key) {
+			int *counts = malloc(pixel_count * sizeof(int));
+			fseek(file, pixel_count * sizeof(film[0]), SEEK_CUR);
+			if (counts && fread(counts, sizeof(int), pixel_count, file) == pixel_count) {
+				samples = INT32_MAX;
+				for (int i = 0; i < pixel_count; ++i)
+					if (in_region(i) && counts[i] < samples)
+						samples = counts[i];
+			}
+			free(counts);
+		}
+		fclose(file);
+		if (samples >= region_samples())
+			return 1;
+	}
+
+	mkdir(directory, 0777);
+	// a truncated name could be some other store's temporary
+	if (snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(temporary))
+		return 0;
+	file = fopen(temporary, "wb");
+	if (!file)
+		return 0;
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.key = key;
+	header.width = image_width;
+	header.height = image_height;
+
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1 && film_write(file);
+	return file_commit(file, temporary, path, ok);
+}
+
+// write next to the destination and rename over it, so whoever is watching
+// the snapshot never opens a half written png
+int png_write(const char *path, const Color8 *pixels) {
+	char temporary[4096];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+	uint64_t begin = trace_begin();
+	int stage = profile_enter(STAGE_ENCODE);
+	int ok = stbi_write_png(temporary, image_width, image_height, 3, pixels, 0);
+	profile_leave(stage);
+	trace_end("write png", begin, -1);
+
+	return ok && rename(temporary, path) == 0;
+}
+
+int write_snapshot(const char *path) {
+	counters_thread_start();
+	counters_phase(PHASE_POST);
+
+	uint64_t begin = trace_begin();
+	tone_map();
+	trace_end("tone map", begin, -1);
+
+	int ok = png_write(path, image);
+
+	counters_thread_stop();
+	return ok;
+}
+
+// primary sample space metropolis (--integrator mlt). a bootstrap of
+// independent paths estimates how bright the whole image is, then a fixed
+// number of chains, each started on a bootstrap path picked by how bright
+// it is, wander through the random numbers ray_trace reads. a bright,
+// hard to find path (a caustic through glass) keeps getting small
+// variations once a chain is on it. every mutation splats both the
+// proposal and the path the chain is at, weighted by how likely the
+// chain is to move. the chains are items of the pool, not threads, so
+// the image doesn't depend on the thread count
+#define MLT_BOOTSTRAP 65536
+#define MLT_BOOTSTRAP_CHUNK 256
+#define MLT_CHAINS 1024
+#define MLT_CHECK_INTERVAL 1024
+
+MltChain *mlt_chains;
+float *mlt_bootstrap;
+uint64_t mlt_deadline;
+
+// what the chains visit proportionally to
+float mlt_importance(Vector3 value) {
+	return 0.2126f * value.x + 0.7152f * value.y + 0.0722f * value.z;
+}
+
+// the path a chain's coordinates describe: the first two place it on the
+// film, the rest go to ray_trace like any sampler's would
+Vector3 mlt_path(int *pixel) {
+	float u[2];
+	sampler_next(u, 2);
+	float x = u[0] * image_width;
+	float y = u[1] * image_height;
+	int px = (int)x < image_width ? (int)x : image_width - 1;
+	int py = (int)y < image_height ? (int)y : image_height - 1;
+	*pixel = py * image_width + px;
+	return ray_trace(camera_ray_at(x, y));
+}
+
+// a chain at iteration 0 whose coordinates all come fresh from a generator
+// seeded by index, so bootstrap path index can be walked again exactly
+void mlt_chain_reset(MltChain *chain, uint32_t index) {
+	memset(chain, 0, sizeof(*chain));
+	chain->large = 1;
+	random_seed(index, UINT32_MAX);
+	chain->random = random_state;
+}
+
+void mlt_bootstrap_job(int item) {
+	MltChain chain;
+	for (int i = item * MLT_BOOTSTRAP_CHUNK; i < (item + 1) * MLT_BOOTSTRAP_CHUNK; ++i) {
+		mlt_chain_reset(&chain, i);
+		sampler_chain = &chain;
+		int pixel;
+		mlt_bootstrap[i] = mlt_importance(mlt_path(&pixel));
+	}
+	sampler_chain = NULL;
+}
+
+void mlt_start_job(int c) {
+	MltChain *chain = &mlt_chains[c];
+	random_seed(c, UINT32_MAX - 1);
+	float u = random_float() * mlt_bootstrap[MLT_BOOTSTRAP - 1];
+	uint32_t state = random_state;
+
+	// mlt_bootstrap holds running sums by now
+	int lo = 0, hi = MLT_BOOTSTRAP - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (mlt_bootstrap[mid] <= u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	mlt_chain_reset(chain, lo);
+	sampler_chain = chain;
+	random_state = chain->random;
+	chain->value = mlt_path(&chain->pixel);
+	chain->importance = mlt_importance(chain->value);
+	// chains that start on the same path still go their own ways
+	chain->random = state;
+	sampler_chain = NULL;
+}
+
+void mlt_chain_job(int c) {
+	MltChain *chain = &mlt_chains[c];
+	sampler_chain = chain;
+	random_state = chain->random;
+	for (long i = 0; i < chain->todo; ++i) {
+		if (i % MLT_CHECK_INTERVAL == 0 && (time_now() >= mlt_deadline || stop_requested))
+			break;
+
+		mlt_start_iteration(chain);
+		int pixel;
+		Vector3 value = mlt_path(&pixel);
+		float importance = mlt_importance(value);
+		float accept = chain->importance > 0.0f ? fminf(1.0f, importance / chain->importance) : 1.0f;
+		if (accept > 0.0f)
+			film_splat_add(pixel, vector3_scale(value, vector3_all(accept / importance)));
+		if (accept < 1.0f)
+			film_splat_add(chain->pixel, vector3_scale(chain->value, vector3_all((1.0f - accept) / chain->importance)));
+
+		if (random_float() < accept) {
+			chain->value = value;
+			chain->importance = importance;
+			chain->pixel = pixel;
+			mlt_accept(chain);
+		} else {
+			mlt_reject(chain);
+		}
+		chain->mutations += 1;
+	}
+	chain->random = random_state;
+	sampler_chain = NULL;
+}
+
+// --spp N spends N mutations per pixel, in passes that double them like
+// the path integrator's, each ending in a snapshot
+int run_mlt(int threadCount, int samples, double timeBudget, const char *outputPath) {
+	uint64_t start = time_now();
+	mlt_deadline = timeBudget > 0.0 ? start + (uint64_t)(timeBudget * 1e9) : UINT64_MAX;
+	mlt_bootstrap = malloc(MLT_BOOTSTRAP * sizeof(float));
+	mlt_chains = malloc(MLT_CHAINS * sizeof(MltChain));
+	assert(mlt_bootstrap && mlt_chains);
+
+	uint64_t begin = trace_begin();
+	pool_run(threadCount, "mlt bootstrap", mlt_bootstrap_job, MLT_BOOTSTRAP / MLT_BOOTSTRAP_CHUNK);
+	for (int i = 1; i < MLT_BOOTSTRAP; ++i)
+		mlt_bootstrap[i] += mlt_bootstrap[i - 1];
+	double brightness = mlt_bootstrap[MLT_BOOTSTRAP - 1] / MLT_BOOTSTRAP;
+	if (brightness > 0.0)
+		pool_run(threadCount, "mlt start", mlt_start_job, MLT_CHAINS);
+	trace_end("mlt bootstrap", begin, -1);
+	fprintf(stderr, "mlt: %d chains, brightness %g, %.2f s\n", MLT_CHAINS, brightness, (time_now() - start) / 1e9);
+
+	long budget = brightness > 0.0 ? (long)samples * pixel_count : 0;
+	long done = 0;
+	int ok = 1;
+	for (int pass = 0; ok && done < budget && time_now() < mlt_deadline && !stop_requested; ++pass) {
+		long goal = done ? 2 * done : pixel_count;
+		goal = goal < budget ? goal : budget;
+		for (int c = 0; c < MLT_CHAINS; ++c)
+			mlt_chains[c].todo = (goal - done) / MLT_CHAINS + (c < (goal - done) % MLT_CHAINS);
+
+		begin = trace_begin();
+		pool_run(threadCount, "mlt", mlt_chain_job, MLT_CHAINS);
+		trace_end("render pass", begin, -1);
+
+		long before = done;
+		done = 0;
+		for (int c = 0; c < MLT_CHAINS; ++c)
+			done += mlt_chains[c].mutations;
+		mlt_scale = done ? brightness * pixel_count / done : 0.0;
+		ok = write_snapshot(outputPath);
+		fprintf(stderr, "pass %d: %.1f mutations per pixel, %.2f s%s\n", pass, (double)done / pixel_count,
+			(time_now() - start) / 1e9, done - before < goal - before ? " (stopped early)" : "");
+	}
+	// a black scene still gets its image
+	if (ok && !done)
+		ok = write_snapshot(outputPath);
+	if (!ok)
+		fprintf(stderr, "could not write %s\n", outputPath);
+
+	free(mlt_chains);
+	free(mlt_bootstrap);
+	return ok;
+}
+
+// interactive look development (--lookdev). commands come one per line on
+// stdin and the film is kept between them, so an edit only costs the
+// pixels it actually changes:
+//   render N                    bring every pixel up to N samples, write the png
+//   camera x y z tx ty tz fov   move the camera, reprojecting what is still visible
+//   material I metallic roughness [r g b]
+//                               edit material I, dropping the pixels whose paths hit it
+//   quit
+// every command is answered by one line on stdout
+#define REPROJECT_MAX_SAMPLES 64
+#define REPROJECT_DEPTH_TOLERANCE 0.01
+
+void film_clear_pixel(int i) {
+	film[i] = vector3_all(0.0);
+	film_samples[i] = 0;
+	film_mean[i] = 0.0;
+	film_m2[i] = 0.0;
+	film_touched[i] = 0;
+}
+
+// move the camera and carry each pixel's samples over from wherever its
+// primary hit was seen before. the hit has to be on the same sphere at the
+// same distance from the old camera, otherwise it was hidden there. glossy
+// shading does change with the view, so reprojected pixels keep at most
+// REPROJECT_MAX_SAMPLES and fresh samples soon outweigh them. returns the
+// number of pixels that kept samples
+int lookdev_camera(Camera view) {
+	Camera old = camera;
+	Vector3 *oldFilm = malloc(pixel_count * sizeof(Vector3));
+	int *oldSamples = malloc(pixel_count * sizeof(int));
+	double *oldMean = malloc(pixel_count * sizeof(double));
+	double *oldM2 = malloc(pixel_count * sizeof(double));
+	uint64_t *oldTouched = malloc(pixel_count * sizeof(uint64_t));
+	int *oldPrimary = malloc(pixel_count * sizeof(int));
+	float *oldDepth = malloc(pixel_count * sizeof(float));
+	assert(oldFilm && oldSamples && oldMean && oldM2 && oldTouched && oldPrimary && oldDepth);
+	memcpy(oldFilm, film, pixel_count * sizeof(Vector3));
+	memcpy(oldSamples, film_samples, pixel_count * sizeof(int));
+	memcpy(oldMean, film_mean, pixel_count * sizeof(double));
+	memcpy(oldM2, film_m2, pixel_count * sizeof(double));
+	memcpy(oldTouched, film_touched, pixel_count * sizeof(uint64_t));
+	memcpy(oldPrimary, film_primary, pixel_count * sizeof(int));
+	memcpy(oldDepth, film_depth, pixel_count * sizeof(float));
+
+	camera = view;
+	int kept = 0;
+	for (int i = 0; i < pixel_count; ++i) {
+		film_clear_pixel(i);
+
+		Line ray = camera_ray(i % image_width, i / image_width);
+		Hit hit = scene_intersect(ray);
+		film_primary[i] = hit.sphere;
+		film_depth[i] = hit.distance;
+
+		// the sky is only a direction, anything else a point
+		Vector3 d = hit.sphere < 0 ? ray.direction : vector3_subtract(hit.point, old.origin);
+		int j = camera_pixel(old, d);
+		if (j < 0 || !oldSamples[j] || oldPrimary[j] != hit.sphere)
+			continue;
+		if (hit.sphere >= 0 && fabsf(vector3_length(d) - oldDepth[j]) > REPROJECT_DEPTH_TOLERANCE * oldDepth[j])
+			continue;
+
+		int n = oldSamples[j] < REPROJECT_MAX_SAMPLES ? oldSamples[j] : REPROJECT_MAX_SAMPLES;
+		film[i] = vector3_scale(oldFilm[j], vector3_all((float)n / oldSamples[j]));
+		film_samples[i] = n;
+		film_mean[i] = oldMean[j];
+		film_m2[i] = oldM2[j] * n / oldSamples[j];
+		film_touched[i] = oldTouched[j];
+		kept += 1;
+	}
+
+	free(oldFilm);
+	free(oldSamples);
+	free(oldMean);
+	free(oldM2);
+	free(oldTouched);
+	free(oldPrimary);
+	free(oldDepth);
+	return kept;
+}
+
+// returns the number of pixels that lost their samples
+int lookdev_material(int index, float metallic, float roughness, Vector3 color, int hasColor) {
+	Material *material = &materials[index];
+	material->metallic = metallic;
+	material->roughness = roughness;
+	if (hasColor)
+		material->color = color;
+	// metals and layered materials move between the two kernels, the other
+	// classes only take the roughness and color
+	if (material->kind == MATERIAL_METAL || material->kind == MATERIAL_LAYERED)
+		material->kind = metallic == 1.0 ? MATERIAL_METAL : MATERIAL_LAYERED;
+
+	int dropped = 0;
+	for (int i = 0; i < pixel_count; ++i) {
+		if (film_touched[i] & material_bit(index)) {
+			film_clear_pixel(i);
+			dropped += 1;
+		}
+	}
+	return dropped;
+}
+
+int lookdev(int threadCount, const char *outputPath) {
+	char line[1024];
+	while (!stop_requested && fgets(line, sizeof(line), stdin)) {
+		char command[32];
+		Vector3 a, b;
+		float f, g;
+		int n;
+		if (sscanf(line, "%31s", command) != 1)
+			continue;
+
+		if (!strcmp(command, "render") && sscanf(line, "%*s %d", &n) == 1 && n > 0) {
+			uint64_t start = time_now();
+			long planned = plan_pass(0, n, 0.0, 0);
+			render_pass(threadCount, UINT64_MAX);
+			if (!write_snapshot(outputPath)) {
+				printf("error could not write %s\n", outputPath);
+			} else {
+				printf("ok rendered %ld samples in %.2f s\n", planned, (time_now() - start) / 1e9);
+			}
+		} else if (!strcmp(command, "camera")
+			&& sscanf(line, "%*s %f %f %f %f %f %f %f", &a.x, &a.y, &a.z, &b.x, &b.y, &b.z, &f) == 7) {
+			int kept = lookdev_camera(camera_look_at(a, b, tan(f * M_PI / 360.0)));
+			printf("ok reprojected %d of %d pixels\n", kept, pixel_count);
+		} else if (!strcmp(command, "material")
+			&& sscanf(line, "%*s %d %f %f", &n, &f, &g) == 3) {
+			if (n < 0 || n >= material_count) {
+				printf("error no material %d\n", n);
+			} else {
+				int hasColor = sscanf(line, "%*s %*d %*f %*f %f %f %f", &a.x, &a.y, &a.z) == 3;
+				int dropped = lookdev_material(n, f, g, a, hasColor);
+				// pixels that took photons through the material were dropped
+				// with the rest, so the new map only has to exist before the
+				// next render
+				if (photon_emit)
+					photon_build(threadCount);
+				printf("ok dropped %d of %d pixels\n", dropped, pixel_count);
+			}
+		} else if (!strcmp(command, "quit")) {
+			printf("ok\n");
+			break;
+		} else {
+			printf("error bad command: %s", line);
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
+
+// animation sequences (--animation FILE). the file says how the scene
+// changes over time, everything after a "frame" line applies from that
+// frame on:
+//   frame
+//   camera x y z  target_x target_y target_z  vertical_fov_degrees
+//   move I  x y z  [radius]
+//   place I  x y z  [yaw_degrees [scale | scale_x scale_y scale_z]]
+// move changes loose sphere I, place puts instance I somewhere else.
+// scene, film and render threads are set up once for the whole sequence.
+// an encoder thread tone maps and writes frame N while frame N+1 renders
+typedef struct {
+	int frame;
+	int sphere; // both -1 for the camera
+	int instance;
+	Camera camera;
+	Vector3 center;
+	float radius; // below 0 keeps the radius
+	float yaw;
+	Vector3 scale;
+} Change;
+
+int animation_load(const char *path, Change **changes, int *changeCount) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "could not open animation %s\n", path);
+		return 0;
+	}
+
+	*changes = NULL;
+	*changeCount = 0;
+	int capacity = 0;
+	int frames = 0;
+	int ok = 1;
+	char line[1024];
+	for (int number = 1; ok && fgets(line, sizeof(line), file); ++number) {
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char keyword[32];
+		Change change = {frames ? frames - 1 : 0, -1, -1};
+		Vector3 target;
+		float f;
+		int n, offset;
+		if (sscanf(line, "%31s", keyword) != 1)
+			continue;
+
+		if (!strcmp(keyword, "frame")) {
+			frames += 1;
+			continue;
+		} else if (!strcmp(keyword, "camera")
+			&& sscanf(line, "%*s %f %f %f %f %f %f %f", &change.center.x, &change.center.y, &change.center.z,
+				&target.x, &target.y, &target.z, &f) == 7) {
+			change.camera = camera_look_at(change.center, target, tan(f * M_PI / 360.0));
+		} else if (!strcmp(keyword, "move")
+			&& ((n = sscanf(line, "%*s %d %f %f %f %f", &change.sphere, &change.center.x, &change.center.y,
+				&change.center.z, &change.radius)) == 4 || n == 5)
+			&& change.sphere >= 0 && change.sphere < sphere_count) {
+			change.radius = n == 5 ? change.radius : -1.0;
+		} else if (!strcmp(keyword, "place")
+			&& sscanf(line, "%*s %d %n", &change.instance, &offset) == 1
+			&& change.instance >= 0 && change.instance < instance_count
+			&& placement_parse(line + offset, &change.center, &change.yaw, &change.scale)) {
+		} else {
+			fprintf(stderr, "%s:%d: can't parse \"%s\"\n", path, number, keyword);
+			ok = 0;
+			break;
+		}
+
+		if (*changeCount == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			*changes = realloc(*changes, capacity * sizeof(Change));
+			assert(*changes);
+		}
+		(*changes)[(*changeCount)++] = change;
+	}
+	fclose(file);
+
+	if (ok && !frames) {
+		fprintf(stderr, "%s: no frames\n", path);
+		ok = 0;
+	}
+	if (!ok) {
+		free(*changes);
+		*changes = NULL;
+		return 0;
+	}
+	return frames;
+}
+
+// image/image.png becomes image/image.0007.png
+void frame_path(char *out, size_t size, const char *path, int frame) {
+	const char *slash = strrchr(path, '/');
+	const char *dot = strrchr(path, '.');
+	if (!dot || (slash && dot < slash))
+		dot = path + strlen(path);
+	snprintf(out, size, "%.*s.%04d%s", (int)(dot - path), path, frame, dot);
+}
+
+// a one frame queue: submitting waits until the previous frame is written,
+// so there is never more than one frame in flight besides the one rendering
+pthread_mutex_t encoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t encoder_changed = PTHREAD_COND_INITIALIZER;
+Vector3 *encoder_film;
+int *encoder_samples;
+Color8 *encoder_pixels;
+char encoder_path[4096];
+int encoder_pending = 0;
+int encoder_quit = 0;
+int encoder_failed = 0;
+
+void *encoder_worker(void *arg) {
+	(void)arg;
+	thread_index = ENCODER_THREAD;
+
+	pthread_mutex_lock(&encoder_mutex);
+	for (;;) {
+		while (!encoder_pending && !encoder_quit)
+			pthread_cond_wait(&encoder_changed, &encoder_mutex);
+		if (!encoder_pending)
+			break;
+		pthread_mutex_unlock(&encoder_mutex);
+
+		uint64_t begin = trace_begin();
+		tone_map_pixels(encoder_film, encoder_samples, encoder_pixels);
+		trace_end("tone map", begin, -1);
+		int ok = png_write(encoder_path, encoder_pixels);
+
+		pthread_mutex_lock(&encoder_mutex);
+		if (!ok) {
+			fprintf(stderr, "could not write %s\n", encoder_path);
+			encoder_failed = 1;
+		}
+		encoder_pending = 0;
+		pthread_cond_broadcast(&encoder_changed);
+	}
+	pthread_mutex_unlock(&encoder_mutex);
+	return NULL;
+}
+
+void encoder_submit(const char *path) {
+	pthread_mutex_lock(&encoder_mutex);
+	while (encoder_pending)
+		pthread_cond_wait(&encoder_changed, &encoder_mutex);
+	memcpy(encoder_film, film, pixel_count * sizeof(Vector3));
+	memcpy(encoder_samples, film_samples, pixel_count * sizeof(int));
+	snprintf(encoder_path, sizeof(encoder_path), "%s", path);
+	encoder_pending = 1;
+	pthread_cond_broadcast(&encoder_changed);
+	pthread_mutex_unlock(&encoder_mutex);
+}
+
+// renders every frame to samples spp, or for at most frameBudget seconds
+int run_animation(const char *path, int threadCount, int samples, double frameBudget, const char *outputPath) {
+	Change *changes;
+	int changeCount;
+	int frames = animation_load(path, &changes, &changeCount);
+	if (!frames)
+		return 0;
+
+	encoder_film = malloc(pixel_count * sizeof(Vector3));
+	encoder_samples = malloc(pixel_count * sizeof(int));
+	encoder_pixels = malloc(pixel_count * sizeof(Color8));
+	assert(encoder_film && encoder_samples && encoder_pixels);
+	pthread_t encoder;
+	pthread_create(&encoder, NULL, encoder_worker, NULL);
+
+	uint64_t start = time_now();
+	int next = 0;
+	int frame = 0;
+	for (; frame < frames && !stop_requested; ++frame) {
+		uint64_t frameStart = time_now();
+		sampler_frame = frame;
+		int moved = 0, placed = 0;
+		for (; next < changeCount && changes[next].frame == frame; ++next) {
+			Change *change = &changes[next];
+			if (change->sphere >= 0) {
+				spheres[change->sphere].center = change->center;
+				if (change->radius >= 0.0)
+					spheres[change->sphere].radius = change->radius;
+				moved = 1;
+			} else if (change->instance >= 0) {
+				instance_place(&instances[change->instance], change->center, change->yaw, change->scale);
+				placed = 1;
+			} else {
+				camera = change->camera;
+			}
+		}
+
+		char update[64] = "";
+		uint64_t begin = trace_begin();
+		if (moved || placed) {
+			const char *updates[] = {"refit", "partly rebuilt", "rebuilt"};
+			int kind = scene_bvh_update(threadCount, moved, placed);
+			snprintf(update, sizeof(update), ", bvh %s in %.2f ms", updates[kind], (time_now() - frameStart) / 1e6);
+			trace_end("bvh update", begin, -1);
+			if (moved && restir)
+				emitters_build();
+			if (photon_emit) {
+				begin = trace_begin();
+				photon_build(threadCount);
+				trace_end("photons", begin, -1);
+			}
+		}
+
+		for (int i = 0; i < pixel_count; ++i)
+			film_clear_pixel(i);
+		plan_pass(0, samples, 0.0, 0);
+
+		begin = trace_begin();
+		render_pass(threadCount, frameBudget > 0.0 ? frameStart + (uint64_t)(frameBudget * 1e9) : UINT64_MAX);
+		trace_end("render frame", begin, -1);
+
+		char output[4096];
+		frame_path(output, sizeof(output), outputPath, frame);
+		begin = trace_begin();
+		encoder_submit(output);
+		trace_end("submit frame", begin, -1);
+
+		fprintf(stderr, "frame %d: %.2f s%s%s\n", frame, (time_now() - frameStart) / 1e9,
+			update, pass_remaining() ? " (stopped early)" : "");
+	}
+
+	pthread_mutex_lock(&encoder_mutex);
+	encoder_quit = 1;
+	pthread_cond_broadcast(&encoder_changed);
+	pthread_mutex_unlock(&encoder_mutex);
+	pthread_join(encoder, NULL);
+	fprintf(stderr, "%d of %d frames in %.2f s\n", frame, frames, (time_now() - start) / 1e9);
+
+	free(changes);
+	free(encoder_film);
+	free(encoder_samples);
+	free(encoder_pixels);
+	return !encoder_failed;
+}
+
+// distributed rendering. a coordinator (--coordinator ADDRESS) cuts the
+// frame into jobs of one tile and JOB_SAMPLES consecutive sample numbers and
+// hands them to workers (--worker ADDRESS) over a unix or tcp socket. every
+// worker thread holds its own connection and runs one job at a time.
+// messages are raw structs, so all hosts must share the same byte order.
+#define NET_MAGIC 0x52545735u
+#define WORKER_CONNECT_TIMEOUT 10
+#define WORKER_READ_TIMEOUT 30
+
+typedef struct {
+	uint32_t magic;
+	int32_t width;
+	int32_t height;
+	int32_t bounces;
+	uint64_t scene;
+} NetHello;
+
+
+typedef struct {
+	// -1 tells the worker there is nothing left to do
+	int32_t id;
+	int32_t tile;
+	int32_t firstSample;
+	int32_t count;
+} NetJob;
+
+typedef struct {
+	int32_t id;
+	int32_t pixels;
+} NetResult;
+
+typedef struct {
+	float sum[3];
+	int32_t samples;
+	double mean;
+	double m2;
+} NetPixel;
+
+int write_all(int fd, const void *data, size_t size) {
+	const char *p = data;
+	while (size) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+int read_all(int fd, void *data, size_t size) {
+	char *p = data;
+	while (size) {
+		ssize_t n = recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+// ADDRESS is unix:PATH or HOST:PORT, an empty HOST listens on every interface
+int net_socket(const char *address, int listening) {
+	if (!strncmp(address, "unix:", 5)) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", address + 5);
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if (listening) {
+			unlink(addr.sun_path);
+			if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0)
+				return fd;
+		} else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		close(fd);
+		return -1;
+	}
+
+	const char *colon = strrchr(address, ':');
+	if (!colon)
+		return -1;
+	char host[256];
+	snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+
+	struct addrinfo hints, *list;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &list))
+		return -1;
+
+	int fd = -1;
+	for (struct addrinfo *ai = list; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+				break;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+const char *worker_address;
+
+void *worker_thread(void *arg) {
+	const char *address = worker_address;
+	thread_index = (int)(intptr_t)arg;
+
+	int fd = -1;
+	for (int attempt = 0; fd < 0 && attempt < WORKER_CONNECT_TIMEOUT * 10; ++attempt) {
+		fd = net_socket(address, 0);
+		if (fd < 0)
+			usleep(100000);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "worker: could not connect to %s\n", address);
+		return NULL;
+	}
+
+	NetHello hello = {NET_MAGIC, image_width, image_height, BOUNCE_COUNT, frame_hash()};
+	NetPixel pixels[TILE_SIZE * TILE_SIZE];
+	NetJob job;
+	if (!write_all(fd, &hello, sizeof(hello))) {
+		close(fd);
+		return NULL;
+	}
+
+	while (read_all(fd, &job, sizeof(job)) && job.id >= 0) {
+		int x0, y0, x1, y1;
+		tile_bounds(job.tile, &x0, &y0, &x1, &y1);
+
+		uint64_t begin = trace_begin();
+		int n = 0;
+		for (int y = y0; y < y1; ++y) {
+			for (int x = x0; x < x1; ++x) {
+				PixelSum pixel = {{0.0, 0.0, 0.0}, 0, 0.0, 0.0, 0};
+				render_pixel(x, y, job.firstSample, job.count, &pixel);
+				pixels[n].sum[0] = pixel.sum.x;
+				pixels[n].sum[1] = pixel.sum.y;
+				pixels[n].sum[2] = pixel.sum.z;
+				pixels[n].samples = pixel.samples;
+				pixels[n].mean = pixel.mean;
+				pixels[n].m2 = pixel.m2;
+				++n;
+			}
+		}
+		trace_end("tile", begin, job.tile);
+
+		NetResult result = {job.id, n};
+		if (!write_all(fd, &result, sizeof(result)) || !write_all(fd, pixels, n * sizeof(NetPixel)))
+			break;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+int run_worker(const char *address, int threadCount) {
+	pthread_t threads[MAX_THREADS];
+	worker_address = address;
+	// thread indices as in the pool, so every thread traces into its own buffer
+	for (int t = 0; t < threadCount; ++t)
+		pthread_create(&threads[t], NULL, worker_thread, (void *)(intptr_t)(t + 1));
+	for (int t = 0; t < threadCount; ++t)
+		pthread_join(threads[t], NULL);
+	return 0;
+}
+
+enum { JOB_PENDING, JOB_RUNNING, JOB_DONE };
+
+typedef struct {
+	int tile;
+	int firstSample;
+	int count;
+	int state;
+	// workers running it, more than one once it has been handed out again
+	int copies;
+	uint64_t started;
+	// finished ahead of an earlier job of the same tile, waiting to be merged
+	NetPixel *result;
+} Job;
+
+typedef struct {
+	int fd;
+	int job;
+	int greeted;
+} Connection;
+
+// chan et al.'s pairwise update, folds a worker's partial welford state in
+void merge_pixel(int index, NetPixel *pixel) {
+	int n = film_samples[index] + pixel->samples;
+	if (!pixel->samples)
+		return;
+	double delta = pixel->mean - film_mean[index];
+	film_mean[index] += delta * pixel->samples / n;
+	film_m2[index] += pixel->m2 + delta * delta * film_samples[index] * (double)pixel->samples / n;
+	film[index] = vector3_add(film[index], (Vector3){pixel->sum[0], pixel->sum[1], pixel->sum[2]});
+	film_samples[index] = n;
+}
+
+void merge_job(Job *job, NetPixel *pixels) {
+	int x0, y0, x1, y1, n = 0;
+	tile_bounds(job->tile, &x0, &y0, &x1, &y1);
+	for (int y = y0; y < y1; ++y)
+		for (int x = x0; x < x1; ++x)
+			merge_pixel(y * image_width + x, &pixels[n++]);
+}
+
+// append to an argument vector of size slots, keeping the last for NULL
+void args_append(char **args, int *count, int size, char *arg) {
+	assert(*count < size - 1);
+	args[(*count)++] = arg;
+}
+
+int run_coordinator(const char *address, int localWorkers, int targetSamples, const char *outputPath,
+	const char *scenePath)
+{
+	int listener = net_socket(address, 1);
+	if (listener < 0) {
+		fprintf(stderr, "could not listen on %s\n", address);
+		return 1;
+	}
+
+	// jobs go out sample range by sample range, so the whole frame sharpens
+	// together, and each tile's ranges are merged in order no matter which
+	// worker finishes first. that keeps the result independent of timing
+	int chunks = (targetSamples + JOB_SAMPLES - 1) / JOB_SAMPLES;
+	int jobCount = chunks * tile_count;
+	Job *jobs = calloc(jobCount, sizeof(Job));
+	int *nextChunk = calloc(tile_count, sizeof(int));
+	for (int i = 0; i < jobCount; ++i) {
+		int chunk = i / tile_count;
+		jobs[i].tile = i % tile_count;
+		jobs[i].firstSample = chunk * JOB_SAMPLES;
+		jobs[i].count = targetSamples - jobs[i].firstSample < JOB_SAMPLES ? targetSamples - jobs[i].firstSample : JOB_SAMPLES;
+	}
+
+	char self[4096];
+	ssize_t selfLength = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	self[selfLength > 0 ? selfLength : 0] = '\0';
+	char width[16], height[16], seed[16], photonCount[16], photonRadius[32];
+	snprintf(photonCount, sizeof(photonCount), "%d", photon_emit);
+	snprintf(photonRadius, sizeof(photonRadius), "%.9g", photon_radius);
+	snprintf(width, sizeof(width), "%d", image_width);
+	snprintf(height, sizeof(height), "%d", image_height);
+	snprintf(seed, sizeof(seed), "%u", render_seed);
+	for (int i = 0; i < localWorkers; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(listener);
+			// room for every optional flag below, grow it with them
+			char *args[24] = {self, "--worker", (char *)address, "--threads", "1", "--width", width, "--height", height,
+				"--seed", seed};
+			int argCount = 11, argSize = sizeof(args) / sizeof(args[0]);
+			if (scenePath) {
+				args_append(args, &argCount, argSize, "--scene");
+				args_append(args, &argCount, argSize, (char *)scenePath);
+			}
+			if (blue_noise)
+				args_append(args, &argCount, argSize, "--blue-noise");
+			if (photon_emit) {
+				args_append(args, &argCount, argSize, "--photons");
+				args_append(args, &argCount, argSize, photonCount);
+				args_append(args, &argCount, argSize, "--photon-radius");
+				args_append(args, &argCount, argSize, photonRadius);
+			}
+			args[argCount] = NULL;
+			execv(self, args);
+			_exit(127);
+		}
+	}
+
+	Connection connections[MAX_THREADS];
+	int connectionCount = 0;
+	int nextPending = 0;
+	int merged = 0;
+	double jobSeconds = 0.0;
+	int timedJobs = 0;
+	uint64_t start = time_now();
+
+	while (merged < jobCount && !stop_requested) {
+		struct pollfd fds[MAX_THREADS + 1];
+		fds[0].fd = listener;
+		fds[0].events = connectionCount < MAX_THREADS ? POLLIN : 0;
+		for (int i = 0; i < connectionCount; ++i) {
+			fds[i + 1].fd = connections[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+		if (poll(fds, connectionCount + 1, 1000) < 0 && errno != EINTR)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listener, NULL, NULL);
+			if (fd >= 0) {
+				struct timeval timeout = {WORKER_READ_TIMEOUT, 0};
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				connections[connectionCount++] = (Connection){fd, -1, 0};
+			}
+		}
+
+		for (int i = connectionCount - 1; i >= 0; --i) {
+			Connection *c = &connections[i];
+			if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			int ok;
+			if (!c->greeted) {
+				NetHello hello;
+				ok = read_all(c->fd, &hello, sizeof(hello)) && hello.magic == NET_MAGIC
+					&& hello.width == image_width && hello.height == image_height && hello.bounces == BOUNCE_COUNT
+					&& hello.scene == frame_hash();
+				if (!ok)
+					fprintf(stderr, "coordinator: dropping a worker built for a different frame\n");
+				c->greeted = ok;
+			} else {
+				NetResult result;
+				NetPixel *pixels = malloc(TILE_SIZE * TILE_SIZE * sizeof(NetPixel));
+				ok = read_all(c->fd, &result, sizeof(result)) && result.id == c->job
+					&& 0 <= result.pixels && result.pixels <= TILE_SIZE * TILE_SIZE
+					&& read_all(c->fd, pixels, result.pixels * sizeof(NetPixel));
+				if (ok) {
+					Job *job = &jobs[c->job];
+					job->copies -= 1;
+					c->job = -1;
+					if (job->state == JOB_RUNNING) {
+						job->state = JOB_DONE;
+						jobSeconds += (time_now() - job->started) / 1e9;
+						timedJobs += 1;
+						job->result = pixels;
+						pixels = NULL;
+
+						// merge whatever is now contiguous for this tile
+						int tile = job->tile;
+						for (int k = nextChunk[tile] * tile_count + tile;
+							k < jobCount && jobs[k].state == JOB_DONE && jobs[k].result;
+							k += tile_count) {
+							merge_job(&jobs[k], jobs[k].result);
+							free(jobs[k].result);
+							jobs[k].result = NULL;
+							nextChunk[tile] += 1;
+							merged += 1;
+							if (merged % tile_count == 0 || merged == jobCount) {
+								write_snapshot(outputPath);
+								fprintf(stderr, "coordinator: %d of %d jobs, %d workers, %.2f s\n",
+									merged, jobCount, connectionCount, (time_now() - start) / 1e9);
+							}
+						}
+					}
+				}
+				free(pixels);
+			}
+
+			if (!ok) {
+				// lost or misbehaving worker, its job goes back in the queue
+				if (c->job >= 0) {
+					Job *job = &jobs[c->job];
+					job->copies -= 1;
+					if (job->state == JOB_RUNNING && job->copies == 0) {
+						job->state = JOB_PENDING;
+						if (c->job < nextPending)
+							nextPending = c->job;
+					}
+				}
+				close(c->fd);
+				connections[i] = connections[--connectionCount];
+			}
+		}
+
+		// hand out work: pending jobs first, then, once the queue is dry,
+		// second copies of jobs that have been out far longer than usual
+		for (int i = 0; i < connectionCount; ++i) {
+			Connection *c = &connections[i];
+			if (!c->greeted || c->job >= 0)
+				continue;
+
+			while (nextPending < jobCount && jobs[nextPending].state != JOB_PENDING)
+				nextPending += 1;
+
+			int next = -1;
+			if (nextPending < jobCount) {
+				next = nextPending;
+			} else if (timedJobs) {
+				double limit = 2.0 * jobSeconds / timedJobs;
+				uint64_t oldest = UINT64_MAX;
+				for (int k = 0; k < jobCount; ++k)
+					if (jobs[k].state == JOB_RUNNING && jobs[k].copies < 2 && jobs[k].started < oldest
+						&& (time_now() - jobs[k].started) / 1e9 > limit) {
+						oldest = jobs[k].started;
+						next = k;
+					}
+			}
+			if (next < 0)
+				break;
+
+			Job *job = &jobs[next];
+			NetJob message = {next, job->tile, job->firstSample, job->count};
+			if (!write_all(c->fd, &message, sizeof(message)))
+				continue;
+			if (job->state == JOB_PENDING)
+				job->started = time_now();
+			job->state = JOB_RUNNING;
+			job->copies += 1;
+			c->job = next;
+		}
+
+		// every local worker gone and nobody else connected: give up
+		if (localWorkers && !connectionCount) {
+			while (waitpid(-1, NULL, WNOHANG) > 0)
+				localWorkers -= 1;
+			if (localWorkers <= 0) {
+				fprintf(stderr, "coordinator: all workers have exited\n");
+				break;
+			}
+		}
+	}
+
+	NetJob quit = {-1, 0, 0, 0};
+	for (int i = 0; i < connectionCount; ++i) {
+		write_all(connections[i].fd, &quit, sizeof(quit));
+		close(connections[i].fd);
+	}
+	close(listener);
+	if (!strncmp(address, "unix:", 5))
+		unlink(address + 5);
+	while (wait(NULL) > 0)
+		;
+
+	for (int i = 0; i < jobCount; ++i)
+		free(jobs[i].result);
+	free(jobs);
+	free(nextChunk);
+
+	if (merged < jobCount) {
+		fprintf(stderr, "coordinator: stopped with %d of %d jobs merged\n", merged, jobCount);
+		return 1;
+	}
+	return 0;
+}
+
+// render service (--serve ADDRESS). a small http/1.0 server on a unix
+// socket or tcp port that keeps scenes loaded between requests:
+//   GET /render?scene=FILE&width=W&height=H&spp=N&region=x0,y0,x1,y1
+//              &camera=x,y,z,tx,ty,tz,fov&format=png|float
+// every parameter is optional. png answers are image/png, float answers
+// are the region's averaged rgb as raw native float32, row by row
+#define MAX_SCENES 16
+#define REQUEST_SIZE 8192
+
+typedef struct {
+	char *data;
+	size_t size;
+	size_t capacity;
+} Buffer;
+
+void buffer_append(void *context, void *data, int size) {
+	Buffer *buffer = context;
+	if (buffer->size + size > buffer->capacity) {
+		buffer->capacity = (buffer->size + size) * 2;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+		assert(buffer->data);
+	}
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+Scene resident_scenes[MAX_SCENES];
+uint64_t resident_used[MAX_SCENES];
+int resident_count = 0;
+uint64_t resident_clock = 0;
+
+// loaded scenes stay in memory until the file on disk changes
+Scene *scene_get(const char *path) {
+	int slot = -1;
+	for (int i = 0; i < resident_count; ++i)
+		if (!strcmp(resident_scenes[i].path, path))
+			slot = i;
+
+	struct stat info;
+	if (slot >= 0 && (!strcmp(path, "default") || (stat(path, &info) == 0 && info.st_mtime == resident_scenes[slot].modified))) {
+		resident_used[slot] = ++resident_clock;
+		return &resident_scenes[slot];
+	}
+
+	Scene scene;
+	if (!strcmp(path, "default"))
+		scene = scene_default();
+	else if (!scene_load(path, &scene))
+		return NULL;
+	scene_bvh_build(&scene);
+
+	if (slot < 0 && resident_count < MAX_SCENES) {
+		slot = resident_count++;
+	} else if (slot < 0) {
+		slot = 0;
+		for (int i = 1; i < resident_count; ++i)
+			if (resident_used[i] < resident_used[slot])
+				slot = i;
+	}
+	// a new slot is still all zeros, which scene_free leaves alone
+	if (slot < resident_count)
+		scene_free(&resident_scenes[slot]);
+
+	resident_scenes[slot] = scene;
+	resident_used[slot] = ++resident_clock;
+	return &resident_scenes[slot];
+}
+
+void url_decode(char *s) {
+	char *out = s;
+	for (; *s; ++s) {
+		if (*s == '%' && s[1] && s[2]) {
+			char hex[3] = {s[1], s[2], '\0'};
+			*out++ = (char)strtol(hex, NULL, 16);
+			s += 2;
+		} else {
+			*out++ = *s == '+' ? ' ' : *s;
+		}
+	}
+	*out = '\0';
+}
+
+void http_reply(int fd, int status, const char *type, const void *body, size_t size, const char *extra) {
+	char head[512];
+	int length = snprintf(head, sizeof(head),
+		"HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: close\r\n\r\n",
+		status, status == 200 ? "OK" : status == 404 ? "Not Found" : "Bad Request", type, size, extra ? extra : "");
+	if (write_all(fd, head, length))
+		write_all(fd, body, size);
+}
+
+void http_error(int fd, int status, const char *message) {
+	http_reply(fd, status, "text/plain", message, strlen(message), NULL);
+}
+
+void serve_request(int fd, int threadCount, const char *cacheDirectory) {
+	char request[REQUEST_SIZE];
+	size_t size = 0;
+	while (size < sizeof(request) - 1) {
+		ssize_t n = recv(fd, request + size, sizeof(request) - 1 - size, 0);
+		if (n <= 0)
+			break;
+		size += n;
+		request[size] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+	request[size] = '\0';
+
+	char target[REQUEST_SIZE];
+	if (sscanf(request, "GET %8191s", target) != 1) {
+		http_error(fd, 400, "only GET is supported\n");
+		return;
+	}
+	char *query = strchr(target, '?');
+	if (query)
+		*query++ = '\0';
+	if (strcmp(target, "/render")) {
+		http_error(fd, 404, "try /render\n");
+		return;
+	}
+
+	char scenePath[4096] = "default";
+	int width = IMAGE_WIDTH, height = IMAGE_HEIGHT, spp = SAMPLE_COUNT;
+	int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+	int floats = 0;
+	int customCamera = 0;
+	Vector3 origin, look;
+	float fov;
+
+	for (char *pair = query ? strtok(query, "&") : NULL; pair; pair = strtok(NULL, "&")) {
+		char *value = strchr(pair, '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		url_decode(value);
+
+		int ok = 1;
+		if (!strcmp(pair, "scene"))
+			snprintf(scenePath, sizeof(scenePath), "%s", value);
+		else if (!strcmp(pair, "width"))
+			ok = sscanf(value, "%d", &width) == 1;
+		else if (!strcmp(pair, "height"))
+			ok = sscanf(value, "%d", &height) == 1;
+		else if (!strcmp(pair, "spp"))
+			ok = sscanf(value, "%d", &spp) == 1;
+		else if (!strcmp(pair, "region"))
+			ok = sscanf(value, "%d,%d,%d,%d", &x0, &y0, &x1, &y1) == 4;
+		else if (!strcmp(pair, "camera"))
+			ok = customCamera = sscanf(value, "%f,%f,%f,%f,%f,%f,%f",
+				&origin.x, &origin.y, &origin.z, &look.x, &look.y, &look.z, &fov) == 7;
+		else if (!strcmp(pair, "format"))
+			ok = (floats = !strcmp(value, "float")) || !strcmp(value, "png");
+		if (!ok) {
+			http_error(fd, 400, "bad parameter\n");
+			return;
+		}
+	}
+
+	if (width < 1 || height < 1 || width > 16384 || height > 16384 || spp < 1) {
+		http_error(fd, 400, "bad size or spp\n");
+		return;
+	}
+	x1 = x1 < 0 ? width : x1;
+	y1 = y1 < 0 ? height : y1;
+	if (x0 < 0 || y0 < 0 || x1 > width || y1 > height || x0 >= x1 || y0 >= y1) {
+		http_error(fd, 400, "region must lie inside the image\n");
+		return;
+	}
+
+	Scene *scene = scene_get(scenePath);
+	if (!scene) {
+		http_error(fd, 400, "could not load scene\n");
+		return;
+	}
+
+	uint64_t begin = time_now();
+	scene_use(scene);
+	if (customCamera)
+		camera = camera_look_at(origin, look, tan(fov * M_PI / 360.0));
+	film_allocate(width, height);
+	region_x0 = x0;
+	region_y0 = y0;
+	region_x1 = x1;
+	region_y1 = y1;
+
+	const char *cache = "off";
+	int cached = cacheDirectory ? cache_load(cacheDirectory) : 0;
+	if (cacheDirectory)
+		cache = cached >= spp ? "hit" : cached ? "topped-up" : "miss";
+
+	if (cached < spp) {
+		plan_pass(0, spp, 0.0, 0);
+		render_pass(threadCount, UINT64_MAX);
+		if (cacheDirectory)
+			cache_store(cacheDirectory);
+	}
+	tone_map();
+
+	char extra[192];
+	snprintf(extra, sizeof(extra), "X-Width: %d\r\nX-Height: %d\r\nX-Samples: %d\r\nX-Cache: %s\r\nX-Render-Seconds: %.4f\r\n",
+		x1 - x0, y1 - y0, region_samples(), cache, (time_now() - begin) / 1e9);
+
+	Buffer body = {NULL, 0, 0};
+	if (floats) {
+		for (int y = y0; y < y1; ++y)
+			for (int x = x0; x < x1; ++x) {
+				int i = y * image_width + x;
+				float n = film_samples[i] ? (float)film_samples[i] : 1.0f;
+				float rgb[3] = {film[i].x / n, film[i].y / n, film[i].z / n};
+				buffer_append(&body, rgb, sizeof(rgb));
+			}
+		http_reply(fd, 200, "application/octet-stream", body.data, body.size, extra);
+	} else {
+		stbi_write_png_to_func(buffer_append, &body, x1 - x0, y1 - y0, 3,
+			image + y0 * image_width + x0, image_width * sizeof(Color8));
+		http_reply(fd, 200, "image/png", body.data, body.size, extra);
+	}
+	free(body.data);
+}
+
+int serve(const char *address, int threadCount, const char *cacheDirectory) {
+	int listener = net_socket(address, 1);
+	if (listener < 0) {
+		fprintf(stderr, "could not listen on %s\n", address);
+		return 1;
+	}
+	scene_get("default");
+	fprintf(stderr, "serving on %s\n", address);
+
+	while (!stop_requested) {
+		struct pollfd pfd = {listener, POLLIN, 0};
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			continue;
+		struct timeval timeout = {WORKER_READ_TIMEOUT, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		serve_request(fd, threadCount, cacheDirectory);
+		close(fd);
+	}
+
+	close(listener);
+	if (!strncmp(address, "unix:", 5))
+		unlink(address + 5);
+	return 0;
+}
+
+// counters, profile and trace once the rendering is done
+int report(const char *profilePath, const char *tracePath, int threadCount) {
+	counters_report();
+
+	if (profilePath) {
+		profile_stop();
+		if (!profile_write(profilePath)) {
+			fprintf(stderr, "could not write profile to %s\n", profilePath);
+			return 0;
+		}
+	}
+
+	if (tracePath && !trace_write(tracePath, threadCount)) {
+		fprintf(stderr, "could not write trace to %s\n", tracePath);
+		return 0;
+	}
+	return 1;
+}
+
+// --check-math: the fast_ functions against libm in double precision over
+// the inputs each is documented for, worst error and speed next to the
+// libm call they stand in for. fails if any goes past its bound
+typedef struct {
+	const char *name;
+	float (*fast)(float);
+	float (*libm)(float);
+	double (*reference)(double);
+	float low, high;
+	// sample log-uniformly instead of uniformly
+	int logarithmic;
+	// errors are relative to max(|reference|, floor)
+	double floor;
+	double bound;
+} MathCheck;
+
+float check_rsqrt(float x) { return fast_rsqrt(x); }
+float check_pow5(float x) { return fast_pow5(x); }
+float check_log2(float x) { return fast_log2(x); }
+float check_exp2(float x) { return fast_exp2(x); }
+float check_exp(float x) { return fast_exp(x); }
+float check_log(float x) { return fast_log(x); }
+float check_gamma(float x) { return fast_gamma(x); }
+// where a fast_ function has a caller, what that caller used before
+float libm_rsqrt(float x) { return 1.0 / sqrt(x); }
+float libm_pow5(float x) { return pow(x, 5.0); }
+float libm_gamma(float x) { return pow(x, 1.0 / 2.2); }
+double reference_rsqrt(double x) { return 1.0 / sqrt(x); }
+double reference_pow5(double x) { return pow(x, 5.0); }
+double reference_gamma(double x) { return pow(x, 1.0 / 2.2); }
+
+#define MATH_CHECK_SAMPLES (1 << 20)
+
+int check_math() {
+	MathCheck checks[] = {
+		{"rsqrt", check_rsqrt, libm_rsqrt, reference_rsqrt, 1e-30f, 1e30f, 1, 0.0, 5e-6},
+		{"pow5", check_pow5, libm_pow5, reference_pow5, 0.0f, 1.0f, 0, 0.0, 3e-7},
+		{"log2", check_log2, log2f, log2, 1e-30f, 1e30f, 1, 1.0, 2e-7},
+		{"exp2", check_exp2, exp2f, exp2, -126.0f, 127.4f, 0, 0.0, 3e-7},
+		{"exp", check_exp, expf, exp, -87.0f, 88.0f, 0, 0.0, 6e-6},
+		{"log", check_log, logf, log, 1e-30f, 1e30f, 1, 1.0, 2e-7},
+		{"gamma", check_gamma, libm_gamma, reference_gamma, 0.0f, 1.0f, 0, 1.0, 1e-6},
+	};
+	int count = sizeof(checks) / sizeof(checks[0]);
+	float *inputs = malloc(MATH_CHECK_SAMPLES * sizeof(float));
+	assert(inputs);
+
+	int failed = 0;
+	printf("%-8s %-22s %12s %12s %10s %10s\n", "function", "inputs", "max error", "bound", "fast ns", "libm ns");
+	for (int c = 0; c < count; ++c) {
+		MathCheck *check = &checks[c];
+		random_seed(c, 0);
+		for (int i = 0; i < MATH_CHECK_SAMPLES; ++i) {
+			float u = random_float();
+			inputs[i] = check->logarithmic
+				? expf(logf(check->low) + u * (logf(check->high) - logf(check->low)))
+				: check->low + u * (check->high - check->low);
+		}
+		// the ends of the range are where approximations tend to break
+		inputs[0] = check->low;
+		inputs[1] = check->high;
+
+		double worst = 0.0;
+		float worstInput = 0.0f;
+		for (int i = 0; i < MATH_CHECK_SAMPLES; ++i) {
+			double reference = check->reference(inputs[i]);
+			double scale = fabs(reference) > check->floor ? fabs(reference) : check->floor;
+			double error = scale > 0.0 ? fabs(check->fast(inputs[i]) - reference) / scale : fabs(check->fast(inputs[i]));
+			if (error > worst) {
+				worst = error;
+				worstInput = inputs[i];
+			}
+		}
+
+		// summed so the calls can't be dropped
+		volatile float sink = 0.0f;
+		float sum = 0.0f;
+		uint64_t start = time_now();
+		for (int i = 0; i < MATH_CHECK_SAMPLES; ++i)
+			sum += check->fast(inputs[i]);
+		uint64_t middle = time_now();
+		for (int i = 0; i < MATH_CHECK_SAMPLES; ++i)
+			sum += check->libm(inputs[i]);
+		uint64_t end = time_now();
+		sink = sum;
+		(void)sink;
+
+		char range[32];
+		snprintf(range, sizeof(range), "[%g, %g]", check->low, check->high);
+		int ok = worst <= check->bound;
+		failed += !ok;
+		printf("%-8s %-22s %12.3g %12.3g %10.2f %10.2f%s", check->name, range, worst, check->bound,
+			(double)(middle - start) / MATH_CHECK_SAMPLES, (double)(end - middle) / MATH_CHECK_SAMPLES,
+			ok ? "\n" : "  FAILED");
+		if (!ok)
+			printf(" at %.9g\n", worstInput);
+	}
+	free(inputs);
+	return failed ? 1 : 0;
+}
+
+void usage(const char *program) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --scene FILE    render the scene described in FILE instead of the built-in one\n"
+		"  --width N, --height N\n"
+		"                  image size (default: %dx%d)\n"
+		"  --seed N        render a different, equally deterministic set of samples\n"
+		"  --blue-noise    spread the error of low sample counts as blue noise, for\n"
+		"                  previews and denoising\n"
+		"  --photons N     trace N photons from emissive spheres first and render\n"
+		"                  caustics through glass from them\n"
+		"  --photon-radius R\n"
+		"                  how far around a point photons count (default: %g)\n"
+		"  --guide         learn where light comes from while rendering and aim\n"
+		"                  bounces there (path integrator)\n"
+		"  --restir        light the first surface from reservoirs of light samples\n"
+		"                  shared between neighbouring pixels and passes, for many\n"
+		"                  emissive spheres (path integrator)\n"
+		"  --radiance-cache fast|unbiased\n"
+		"                  end paths at rough surfaces with the light learned\n"
+		"                  there, slightly blurred, or use it only to trace fewer\n"
+		"                  paths on with the same expected image (path integrator)\n"
+		"  --integrator path|bdpt|mlt\n"
+		"                  trace paths from the camera only (default), from the\n"
+		"                  camera and the lights joined bidirectionally, or with\n"
+		"                  metropolis chains that keep varying the bright paths\n"
+		"                  they find (--spp counts mutations per pixel)\n"
+		"  --cache DIR     reuse and top up finished films stored in DIR\n"
+		"  --output FILE   png to write, rewritten after every pass (default: image/image.png)\n"
+		"  --spp N         stop once every pixel has N samples (default: %d)\n"
+		"  --time SECONDS  stop at this wall-clock budget even if --spp isn't reached\n"
+		"  --adaptive E    stop sampling pixels once their relative error is below E\n"
+		"                  and spend the --spp budget on the noisiest pixels instead\n"
+		"  --checkpoint FILE\n"
+		"                  save the render state to FILE after every pass, every\n"
+		"                  --checkpoint-interval seconds and when stopped early\n"
+		"  --checkpoint-interval SECONDS (default: %d)\n"
+		"  --resume        continue from --checkpoint, using the same --spp and --adaptive\n"
+		"  --coordinator ADDRESS\n"
+		"                  split the frame into jobs for workers connecting to ADDRESS,\n"
+		"                  which is unix:PATH or [HOST]:PORT\n"
+		"  --workers N     with --coordinator, also start N local worker processes\n"
+		"  --worker ADDRESS\n"
+		"                  render jobs from the coordinator at ADDRESS, one per --threads\n"
+		"  --serve ADDRESS\n"
+		"                  run as a render service answering http requests on ADDRESS\n"
+		"  --animation FILE\n"
+		"                  render the frames described in FILE to numbered pngs next to\n"
+		"                  --output, each to --spp samples or --time seconds\n"
+		"  --lookdev       read render, camera and material commands from stdin and\n"
+		"                  re-render only the pixels each edit invalidates\n"
+		"  --threads N     render with N worker threads (default: all cores)\n"
+		"  --check-math    compare the fast float math against libm and exit\n"
+		"  --trace FILE    write a chrome trace-event timeline of the run to FILE\n"
+		"  --counters      report hardware counters (IPC, misses per ray) per phase\n"
+		"  --profile FILE  sample the render with SIGPROF and write a flat profile\n"
+		"                  per stage to FILE (- for stderr)\n",
+		program, IMAGE_WIDTH, IMAGE_HEIGHT, PHOTON_RADIUS, SAMPLE_COUNT, CHECKPOINT_INTERVAL);
+}
+
+int main(int argc, char **argv) {
+	int threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int targetSamples = SAMPLE_COUNT;
+	double timeBudget = 0.0;
+	double threshold = 0.0;
+	double checkpointInterval = CHECKPOINT_INTERVAL;
+	int resume = 0;
+	const char *outputPath = "image/image.png";
+	const char *checkpointPath = NULL;
+	const char *coordinatorAddress = NULL;
+	const char *workerAddress = NULL;
+	const char *serveAddress = NULL;
+	const char *scenePath = NULL;
+	const char *cacheDirectory = NULL;
+	int width = IMAGE_WIDTH;
+	int height = IMAGE_HEIGHT;
+	int localWorkers = 0;
+	int lookdevMode = 0;
+	const char *animationPath = NULL;
+	const char *tracePath = NULL;
+	const char *profilePath = NULL;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+			outputPath = argv[++i];
+		} else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+			scenePath = argv[++i];
+		} else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			render_seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--blue-noise")) {
+			blue_noise = 1;
+		} else if (!strcmp(argv[i], "--photons") && i + 1 < argc) {
+			photon_emit = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--photon-radius") && i + 1 < argc) {
+			photon_radius = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--guide")) {
+			guiding = 1;
+		} else if (!strcmp(argv[i], "--restir")) {
+			restir = 1;
+		} else if (!strcmp(argv[i], "--radiance-cache") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "fast")) {
+				radiance_mode = RADIANCE_FAST;
+			} else if (!strcmp(argv[i], "unbiased")) {
+				radiance_mode = RADIANCE_UNBIASED;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--integrator") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "path")) {
+				integrator = INTEGRATOR_PATH;
+			} else if (!strcmp(argv[i], "bdpt")) {
+				integrator = INTEGRATOR_BDPT;
+			} else if (!strcmp(argv[i], "mlt")) {
+				integrator = INTEGRATOR_MLT;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cacheDirectory = argv[++i];
+		} else if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+			width = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--height") && i + 1 < argc) {
+			height = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+			serveAddress = argv[++i];
+		} else if (!strcmp(argv[i], "--lookdev")) {
+			lookdevMode = 1;
+		} else if (!strcmp(argv[i], "--animation") && i + 1 < argc) {
+			animationPath = argv[++i];
+		} else if (!strcmp(argv[i], "--spp") && i + 1 < argc) {
+			targetSamples = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--time") && i + 1 < argc) {
+			timeBudget = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--adaptive") && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+			checkpointPath = argv[++i];
+		} else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc) {
+			checkpointInterval = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--resume")) {
+			resume = 1;
+		} else if (!strcmp(argv[i], "--coordinator") && i + 1 < argc) {
+			coordinatorAddress = argv[++i];
+		} else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			localWorkers = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--worker") && i + 1 < argc) {
+			workerAddress = argv[++i];
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threadCount = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+			profilePath = argv[++i];
+		} else if (!strcmp(argv[i], "--counters")) {
+			counters_enabled = 1;
+		} else if (!strcmp(argv[i], "--check-math")) {
+			return check_math();
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	threadCount = threadCount < 1 ? 1 : threadCount > MAX_THREADS ? MAX_THREADS : threadCount;
+	targetSamples = targetSamples < 1 ? 1 : targetSamples;
+	if (resume && !checkpointPath) {
+		fprintf(stderr, "--resume needs --checkpoint FILE\n");
+		return 1;
+	}
+	if (coordinatorAddress && (threshold > 0.0 || checkpointPath || timeBudget > 0.0 || cacheDirectory)) {
+		fprintf(stderr, "--coordinator doesn't support --adaptive, --checkpoint, --time or --cache\n");
+		return 1;
+	}
+	if (animationPath && (threshold > 0.0 || checkpointPath || coordinatorAddress || cacheDirectory || lookdevMode)) {
+		fprintf(stderr, "--animation doesn't support --adaptive, --checkpoint, --coordinator, --cache or --lookdev\n");
+		return 1;
+	}
+	if (cacheDirectory && (threshold > 0.0 || resume)) {
+		fprintf(stderr, "--cache only holds uniformly sampled films, it can't be used with --adaptive or --resume\n");
+		return 1;
+	}
+
+	if (width < 1 || height < 1) {
+		fprintf(stderr, "bad image size %dx%d\n", width, height);
+		return 1;
+	}
+	if (photon_emit < 0 || photon_radius <= 0.0f) {
+		fprintf(stderr, "bad photon count or radius\n");
+		return 1;
+	}
+	if (serveAddress && photon_emit) {
+		fprintf(stderr, "--serve doesn't support --photons\n");
+		return 1;
+	}
+	// what was learned lives in this process only and isn't saved
+	if (guiding && (integrator != INTEGRATOR_PATH || checkpointPath || coordinatorAddress || workerAddress ||
+		serveAddress || cacheDirectory || lookdevMode || animationPath)) {
+		fprintf(stderr, "--guide doesn't support --integrator bdpt or mlt, --checkpoint, --coordinator, --worker, --serve, "
+			"--cache, --lookdev or --animation\n");
+		return 1;
+	}
+	// the reservoirs live in this process only too, and a coordinator's
+	// workers would each build up their own. a pixel's samples share its
+	// reservoir, so they are correlated and their variance says too little
+	// about the error for --adaptive to go by
+	if (restir && (integrator != INTEGRATOR_PATH || threshold > 0.0 || checkpointPath || coordinatorAddress ||
+		workerAddress || serveAddress || cacheDirectory || lookdevMode)) {
+		fprintf(stderr, "--restir doesn't support --integrator bdpt or mlt, --adaptive, --checkpoint, --coordinator, "
+			"--worker, --serve, --cache or --lookdev\n");
+		return 1;
+	}
+	if (radiance_mode && (integrator != INTEGRATOR_PATH || checkpointPath || coordinatorAddress || workerAddress ||
+		serveAddress || cacheDirectory || lookdevMode || animationPath)) {
+		fprintf(stderr, "--radiance-cache doesn't support --integrator bdpt or mlt, --checkpoint, --coordinator, "
+			"--worker, --serve, --cache, --lookdev or --animation\n");
+		return 1;
+	}
+	// light tracing splats across the whole film, so it only runs where
+	// one process renders every pixel of it
+	if (integrator != INTEGRATOR_PATH && (threshold > 0.0 || checkpointPath || coordinatorAddress || workerAddress ||
+		serveAddress || cacheDirectory || lookdevMode || animationPath || photon_emit)) {
+		fprintf(stderr, "--integrator bdpt and mlt don't support --adaptive, --checkpoint, --coordinator, --worker, "
+			"--serve, --cache, --lookdev, --animation or --photons\n");
+		return 1;
+	}
+
+	signal(SIGTERM, stop_signal);
+	signal(SIGINT, stop_signal);
+
+	if (blue_noise)
+		blue_noise_build();
+
+	if (serveAddress)
+		return serve(serveAddress, threadCount, cacheDirectory);
+
+	trace_enabled = tracePath != NULL;
+	trace_epoch = time_now();
+
+	uint64_t begin = trace_begin();
+	// the globals point into it for the rest of the run
+	static Scene scene;
+	scene = scene_default();
+	if (scenePath && !scene_load(scenePath, &scene))
+		return 1;
+	uint64_t buildBegin = trace_begin();
+	scene_bvh_build(&scene);
+	trace_end("bvh build", buildBegin, -1);
+	scene_use(&scene);
+	film_allocate(width, height);
+	if (integrator == INTEGRATOR_BDPT || restir)
+		emitters_build();
+	if (restir)
+		restir_init();
+	if (guiding)
+		guide_init();
+	if (radiance_mode)
+		radiance_init(2.0f * camera.scale / image_height);
+	trace_end("scene load", begin, -1);
+
+	// the coordinator's workers trace their own
+	if (photon_emit && !coordinatorAddress) {
+		begin = trace_begin();
+		photon_build(threadCount);
+		trace_end("photons", begin, -1);
+	}
+
+	if (workerAddress) {
+		begin = trace_begin();
+		int status = run_worker(workerAddress, threadCount);
+		trace_end("render", begin, -1);
+		if (tracePath && !trace_write(tracePath, threadCount))
+			fprintf(stderr, "could not write trace to %s\n", tracePath);
+		return status;
+	}
+	if (lookdevMode)
+		return lookdev(threadCount, outputPath);
+
+	Progress progress;
+	memset(&progress, 0, sizeof(progress));
+	if (resume) {
+		if (!read_checkpoint(checkpointPath, targetSamples, threshold, &progress))
+			return 1;
+		fprintf(stderr, "resuming at pass %d from %s\n", progress.pass, checkpointPath);
+	}
+	if (cacheDirectory) {
+		progress.samples = cache_load(cacheDirectory);
+		if (progress.samples)
+			fprintf(stderr, "cache: starting from %d spp\n", progress.samples);
+	}
+
+	if (counters_enabled)
+		counters_init();
+	if (profilePath)
+		profile_start();
+
+	if (animationPath) {
+		begin = trace_begin();
+		int ok = run_animation(animationPath, threadCount, targetSamples, timeBudget, outputPath);
+		trace_end("render", begin, -1);
+		return report(profilePath, tracePath, threadCount) && ok ? 0 : 1;
+	}
+
+	if (integrator == INTEGRATOR_MLT) {
+		begin = trace_begin();
+		int ok = run_mlt(threadCount, targetSamples, timeBudget, outputPath);
+		trace_end("render", begin, -1);
+		return report(profilePath, tracePath, threadCount) && ok ? 0 : 1;
+	}
+
+	if (coordinatorAddress) {
+		begin = trace_begin();
+		int status = run_coordinator(coordinatorAddress, localWorkers, targetSamples, outputPath, scenePath);
+		trace_end("render", begin, -1);
+		if (tracePath && !trace_write(tracePath, 0))
+			fprintf(stderr, "could not write trace to %s\n", tracePath);
+		return status;
+	}
+
+	uint64_t start = time_now();
+	uint64_t deadline = timeBudget > 0.0 ? start + (uint64_t)(timeBudget * 1e9) : UINT64_MAX;
+	uint64_t interval = (uint64_t)(checkpointInterval * 1e9);
+	uint64_t nextCheckpoint = checkpointPath && interval ? start + interval : UINT64_MAX;
+
+	// progressive passes, each one doubles the samples every pixel has
+	long budget = (long)targetSamples * pixel_count;
+	int snapshots = 0;
+	while (time_now() < deadline && !stop_requested) {
+		if (!progress.passActive) {
+			if (threshold > 0.0 ? progress.spent >= budget : progress.samples >= targetSamples)
+				break;
+
+			int goal = progress.samples ? 2 * progress.samples : threshold > 0.0 ? ADAPTIVE_MIN_SAMPLES : 1;
+			goal = goal < targetSamples ? goal : targetSamples;
+			long passBudget = progress.spent < budget - progress.spent ? progress.spent : budget - progress.spent;
+
+			progress.planned = plan_pass(progress.pass, goal, threshold, passBudget);
+			progress.goal = goal;
+			progress.passActive = 1;
+			if (!progress.planned && threshold > 0.0)
+				break;
+		}
+
+		begin = trace_begin();
+		render_pass(threadCount, deadline < nextCheckpoint ? deadline : nextCheckpoint);
+		trace_end("render pass", begin, -1);
+
+		int finished = !pass_remaining();
+		if (finished) {
+			progress.passActive = 0;
+			progress.samples = progress.goal;
+			progress.spent += progress.planned;
+			if (guiding)
+				guide_update(threadCount);
+			if (radiance_mode)
+				radiance_update(threadCount);
+		}
+
+		// a pass that stopped at the checkpoint timer just carries on after
+		// the checkpoint, one stopped by the budget or a signal still gets
+		// its snapshot so the work isn't lost
+		int stopped = time_now() >= deadline || stop_requested;
+		if (finished || stopped) {
+			if (!write_snapshot(outputPath)) {
+				fprintf(stderr, "could not write %s\n", outputPath);
+				return 1;
+			}
+			snapshots += 1;
+			if (threshold > 0.0)
+				fprintf(stderr, "pass %d: %.1f spp average, %.2f s%s\n", progress.pass,
+					(double)progress.spent / (pixel_count), (time_now() - start) / 1e9,
+					finished ? "" : " (stopped early)");
+			else
+				fprintf(stderr, "pass %d: %d spp, %.2f s%s\n", progress.pass,
+					finished ? progress.samples : progress.goal, (time_now() - start) / 1e9,
+					finished ? "" : " (stopped early)");
+		}
+		if (finished)
+			progress.pass += 1;
+
+		if (checkpointPath && (finished || stopped || time_now() >= nextCheckpoint)) {
+			begin = trace_begin();
+			if (!write_checkpoint(checkpointPath, targetSamples, threshold, &progress)) {
+				fprintf(stderr, "could not write checkpoint %s\n", checkpointPath);
+				return 1;
+			}
+			trace_end("checkpoint", begin, -1);
+			if (interval)
+				nextCheckpoint = time_now() + interval;
+		}
+	}
+
+	if (threshold > 0.0) {
+		int converged = 0;
+		for (int i = 0; i < pixel_count; ++i)
+			converged += pixel_error(i) <= threshold;
+		fprintf(stderr, "adaptive: %d of %d pixels below %g relative error\n",
+			converged, pixel_count, threshold);
+	}
+
+	// a cache hit renders nothing, but still has to produce the image
+	if (!snapshots && !write_snapshot(outputPath)) {
+		fprintf(stderr, "could not write %s\n", outputPath);
+		return 1;
+	}
+
+	if (cacheDirectory && !cache_store(cacheDirectory))
+		fprintf(stderr, "could not store the film in %s\n", cacheDirectory);
+
+	return report(profilePath, tracePath, threadCount) ? 0 : 1;
 }